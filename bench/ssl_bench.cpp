@@ -0,0 +1,483 @@
+/*
+ * Terasic DE1-SoC driver benchmark
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Measures every device node for a number of concurrent threads and
+ * batch sizes and prints the results as JSON:
+ *
+ *  read:   calls and records per second and the latency of one call.
+ *          hdc/apds pread() the newest record (batch 1) or fetch batch
+ *          records with SSL_SENSOR_IOC_READ_HISTORY, mpu read()s up to
+ *          batch records, sevensegment write()s a display value.
+ *  wakeup: delay from the kernel timestamp of the newest sample to the
+ *          reader being back in userspace. mpu is polled with the ring
+ *          mapped for the timestamps, hdc/apds read in stream mode.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpu.h"
+#include "ssl_sensor.h"
+
+#define POLL_TIMEOUT_MS 100
+#define WAKEUP_BATCH 64 // records per read() in the wakeup test
+#define SEVENSEG_VALUE "012345ff"
+
+enum DeviceKind {
+	KIND_SENSOR,
+	KIND_MPU,
+	KIND_SEVENSEG,
+};
+
+struct Device {
+	std::string name;
+	DeviceKind kind;
+};
+
+struct Stats {
+	uint64_t calls = 0;
+	uint64_t records = 0;
+	uint64_t errors = 0;
+	std::vector<uint64_t> latency; // ns
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * @brief Splits a comma separated list.
+ */
+static std::vector<std::string> split(const char *list)
+{
+	std::vector<std::string> items;
+	std::string item;
+
+	for (const char *c = list; ; c++) {
+		if (*c == ',' || *c == '\0') {
+			if (!item.empty())
+				items.push_back(item);
+			item.clear();
+			if (*c == '\0')
+				break;
+		} else {
+			item += *c;
+		}
+	}
+	return items;
+}
+
+static std::vector<unsigned> split_uint(const char *list)
+{
+	std::vector<unsigned> values;
+
+	for (const std::string &item : split(list))
+		values.push_back(std::max(1, atoi(item.c_str())));
+	return values;
+}
+
+/*
+ * @brief Device kind by name, instances like mpu0 count as mpu.
+ */
+static Device make_device(const std::string &name)
+{
+	if (name.compare(0, 3, "mpu") == 0)
+		return { name, KIND_MPU };
+	if (name.compare(0, 12, "sevensegment") == 0)
+		return { name, KIND_SEVENSEG };
+	return { name, KIND_SENSOR };
+}
+
+/*
+ * @brief Runs one read (or write) benchmark thread until end.
+ */
+static void read_worker(const Device &dev, const std::string &path,
+			unsigned batch, uint64_t end, Stats &st)
+{
+	struct ssl_sensor_info info = {};
+	struct ssl_sensor_history history = {};
+	std::vector<uint8_t> buf;
+	struct pollfd pfd;
+	uint64_t t0;
+	ssize_t n = 0;
+	int fd;
+
+	fd = open(path.c_str(), dev.kind == KIND_SEVENSEG ? O_WRONLY :
+		  O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		st.errors++;
+		return;
+	}
+
+	switch (dev.kind) {
+	case KIND_SENSOR:
+		if (ioctl(fd, SSL_SENSOR_IOC_GET_INFO, &info) < 0) {
+			st.errors++;
+			close(fd);
+			return;
+		}
+		buf.resize(std::max(info.record_size,
+				    batch * info.sample_stride));
+		history.buf = (uintptr_t)buf.data();
+		break;
+	case KIND_MPU:
+		buf.resize(batch * MPU_RECORD_SIZE);
+		break;
+	case KIND_SEVENSEG:
+		break;
+	}
+
+	while (now_ns() < end) {
+		if (dev.kind == KIND_MPU) {
+			// do not count the time waiting for samples
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, POLL_TIMEOUT_MS) <= 0)
+				continue;
+		}
+
+		t0 = now_ns();
+		switch (dev.kind) {
+		case KIND_SENSOR:
+			if (batch == 1) {
+				n = pread(fd, buf.data(), info.record_size, 0);
+				n = n == (ssize_t)info.record_size ? 1 : -1;
+			} else {
+				history.count = batch;
+				n = ioctl(fd, SSL_SENSOR_IOC_READ_HISTORY,
+					  &history);
+				n = n < 0 ? -1 : history.count;
+			}
+			break;
+		case KIND_MPU:
+			n = read(fd, buf.data(), buf.size());
+			if (n < 0 && errno == EAGAIN)
+				n = 0;
+			else if (n > 0)
+				n /= MPU_RECORD_SIZE;
+			break;
+		case KIND_SEVENSEG:
+			n = pwrite(fd, SEVENSEG_VALUE, strlen(SEVENSEG_VALUE), 0);
+			n = n < 0 ? -1 : 1;
+			break;
+		}
+		st.latency.push_back(now_ns() - t0);
+		st.calls++;
+		if (n < 0)
+			st.errors++;
+		else
+			st.records += n;
+	}
+
+	close(fd);
+}
+
+/*
+ * @brief Waits for mpu notifications with the ring mapped, the delay
+ *        is taken against the timestamp of the newest record.
+ */
+static void wakeup_mpu(const std::string &path, uint64_t end, Stats &st)
+{
+	std::vector<uint8_t> buf(WAKEUP_BATCH * MPU_RECORD_SIZE);
+	long page = sysconf(_SC_PAGESIZE);
+	struct mpu_ring_header *hdr;
+	struct mpu_ring_record *records;
+	struct pollfd pfd;
+	size_t len;
+	void *ring;
+	uint64_t t;
+	uint32_t head;
+	ssize_t n;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		st.errors++;
+		return;
+	}
+
+	// map the header first to learn the ring size
+	ring = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		st.errors++;
+		close(fd);
+		return;
+	}
+	hdr = (struct mpu_ring_header *)ring;
+	len = hdr->data_offset + (size_t)hdr->size * hdr->record_size;
+	munmap(ring, page);
+
+	ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		st.errors++;
+		close(fd);
+		return;
+	}
+	hdr = (struct mpu_ring_header *)ring;
+	records = (struct mpu_ring_record *)((uint8_t *)ring +
+					     hdr->data_offset);
+
+	while (now_ns() < end) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, POLL_TIMEOUT_MS) <= 0)
+			continue;
+
+		t = now_ns();
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (head != 0) {
+			st.latency.push_back(t - records[(head - 1) &
+					     (hdr->size - 1)].timestamp);
+			st.calls++;
+		}
+
+		// catch up, the file and the ring have separate positions
+		while ((n = read(fd, buf.data(), buf.size())) > 0)
+			st.records += n / MPU_RECORD_SIZE;
+		__atomic_store_n(&hdr->tail, head, __ATOMIC_RELEASE);
+	}
+
+	munmap(ring, len);
+	close(fd);
+}
+
+/*
+ * @brief Reads a sensor in stream mode, the delay is taken against the
+ *        timestamp of the newest sample returned.
+ */
+static void wakeup_sensor(const std::string &path, uint64_t end, Stats &st)
+{
+	struct ssl_sensor_info info = {};
+	struct ssl_sensor_sample *sample;
+	std::vector<uint8_t> buf;
+	uint32_t mode = SSL_SENSOR_MODE_STREAM;
+	struct pollfd pfd;
+	uint64_t t;
+	ssize_t n;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		st.errors++;
+		return;
+	}
+	if (ioctl(fd, SSL_SENSOR_IOC_GET_INFO, &info) < 0 ||
+	    ioctl(fd, SSL_SENSOR_IOC_SET_MODE, &mode) < 0) {
+		st.errors++;
+		close(fd);
+		return;
+	}
+	buf.resize(WAKEUP_BATCH * info.sample_stride);
+
+	while (now_ns() < end) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, POLL_TIMEOUT_MS) <= 0)
+			continue;
+
+		n = read(fd, buf.data(), buf.size());
+		t = now_ns();
+		if (n < (ssize_t)info.sample_stride) {
+			if (n < 0 && errno != EAGAIN)
+				st.errors++;
+			continue;
+		}
+
+		sample = (struct ssl_sensor_sample *)(buf.data() + n -
+						      info.sample_stride);
+		st.latency.push_back(t - sample->timestamp);
+		st.calls++;
+		st.records += n / info.sample_stride;
+	}
+
+	close(fd);
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1,
+			       (size_t)(p * sorted.size()))];
+}
+
+/*
+ * @brief Prints one result object, merges and sorts the latencies.
+ */
+static void print_result(FILE *out, bool first, const Device &dev,
+			 const char *test, unsigned threads, unsigned batch,
+			 double seconds, std::vector<Stats> &stats)
+{
+	std::vector<uint64_t> latency;
+	uint64_t calls = 0, records = 0, errors = 0;
+
+	for (Stats &st : stats) {
+		calls += st.calls;
+		records += st.records;
+		errors += st.errors;
+		latency.insert(latency.end(), st.latency.begin(),
+			       st.latency.end());
+		std::vector<uint64_t>().swap(st.latency);
+	}
+	std::sort(latency.begin(), latency.end());
+
+	fprintf(out, "%s\n    {\"device\": \"%s\", \"test\": \"%s\", "
+		"\"threads\": %u, \"batch\": %u, \"seconds\": %.3f,\n"
+		"     \"calls\": %llu, \"records\": %llu, \"errors\": %llu, "
+		"\"calls_per_s\": %.1f, \"records_per_s\": %.1f,\n"
+		"     \"%s_ns\": {\"p50\": %llu, \"p99\": %llu, "
+		"\"p999\": %llu, \"max\": %llu}}",
+		first ? "" : ",", dev.name.c_str(), test, threads, batch,
+		seconds, (unsigned long long)calls,
+		(unsigned long long)records, (unsigned long long)errors,
+		calls / seconds, records / seconds,
+		strcmp(test, "wakeup") == 0 ? "delay" : "latency",
+		(unsigned long long)percentile(latency, 0.5),
+		(unsigned long long)percentile(latency, 0.99),
+		(unsigned long long)percentile(latency, 0.999),
+		(unsigned long long)(latency.empty() ? 0 : latency.back()));
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d devices] [-t threads] [-b batches] [-s seconds]\n"
+		"          [-p dir] [-o file]\n"
+		"  -d  comma separated device nodes (hdc0,apds0,mpu0,sevensegment0)\n"
+		"  -t  comma separated reader thread counts (1,2,4)\n"
+		"  -b  comma separated records per call (1,16,64)\n"
+		"  -s  seconds per run (2)\n"
+		"  -p  directory of the device nodes (/dev)\n"
+		"  -o  JSON output file (stdout)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> names = split("hdc0,apds0,mpu0,sevensegment0");
+	std::vector<unsigned> thread_counts = split_uint("1,2,4");
+	std::vector<unsigned> batches = split_uint("1,16,64");
+	std::string dir = "/dev";
+	double seconds = 2;
+	FILE *out = stdout;
+	bool first = true;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:b:s:p:o:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			names = split(optarg);
+			break;
+		case 't':
+			thread_counts = split_uint(optarg);
+			break;
+		case 'b':
+			batches = split_uint(optarg);
+			break;
+		case 's':
+			seconds = atof(optarg);
+			break;
+		case 'p':
+			dir = optarg;
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	fprintf(out, "{\n  \"version\": 1,\n  \"results\": [");
+
+	for (const std::string &name : names) {
+		Device dev = make_device(name);
+		std::string path = dir + "/" + name;
+
+		if (access(path.c_str(), F_OK) != 0) {
+			fprintf(stderr, "%s: %s, skipped\n", path.c_str(),
+				strerror(errno));
+			continue;
+		}
+
+		for (unsigned threads : thread_counts) {
+			for (unsigned batch : batches) {
+				// writes have no batches
+				if (dev.kind == KIND_SEVENSEG && batch != 1)
+					continue;
+
+				std::vector<Stats> stats(threads);
+				std::vector<std::thread> workers;
+				uint64_t end = now_ns() + seconds * 1e9;
+
+				for (unsigned i = 0; i < threads; i++)
+					workers.emplace_back(read_worker,
+							     std::cref(dev),
+							     std::cref(path),
+							     batch, end,
+							     std::ref(stats[i]));
+				for (std::thread &w : workers)
+					w.join();
+
+				print_result(out, first, dev, "read", threads,
+					     batch, seconds, stats);
+				first = false;
+			}
+		}
+
+		if (dev.kind == KIND_SEVENSEG)
+			continue;
+
+		std::vector<Stats> stats(1);
+		uint64_t end = now_ns() + seconds * 1e9;
+
+		if (dev.kind == KIND_MPU)
+			wakeup_mpu(path, end, stats[0]);
+		else
+			wakeup_sensor(path, end, stats[0]);
+		print_result(out, first, dev, "wakeup", 1, 1, seconds, stats);
+		first = false;
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
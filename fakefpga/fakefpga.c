@@ -0,0 +1,310 @@
+/*
+ * Terasic DE1-SoC fake FPGA
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Registers the platform devices of the DE1-SoC design with their
+ * register blocks in RAM, so the drivers can be loaded, exercised and
+ * benchmarked on any machine. An hrtimer fills the blocks with
+ * synthetic waveforms and raises a software interrupt for every mpu.
+ * Each device is registered instances times, like a design with
+ * several IPs of a kind on one bridge.
+ */
+
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/io.h>
+#include <linux/slab.h>
+#include <linux/irq.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/fixp-arith.h>
+
+#include "fakefpga.h"
+
+#define DRIVER_NAME "fakefpga"
+
+// Generator defaults
+#define RATE_HZ 1000
+#define WAVE_PERIOD_MS 1000
+#define IDLE_POLL_MS 100 // while paused
+#define INSTANCES 1 // of every device
+
+// Register blocks, laid out like the FPGA IPs
+#define SENSOR_REGS_SIZE 48 // hdc, apds: 12 data words
+#define MPU_REGS_SIZE 64 // byte registers up to 46
+#define MPU_AXES 9 // accel, gyro, mag
+#define MPU_TIME_OFFSET 18
+#define MPU_EVENT_REGS_OFFSET 37
+#define MPU_EVENT_TIME_OFFSET 6
+#define SEVENSEG_REGS_SIZE 12
+
+static unsigned int rate_hz = RATE_HZ;
+module_param(rate_hz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rate_hz, "Samples generated per second, 0 pauses");
+
+static unsigned int wave_period_ms = WAVE_PERIOD_MS;
+module_param(wave_period_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wave_period_ms, "Period of the synthetic waveforms");
+
+static unsigned int instances = INSTANCES;
+module_param(instances, uint, S_IRUGO);
+MODULE_PARM_DESC(instances, "Number of instances of every device");
+
+struct fakefpga_type {
+	const char *name; // platform driver to bind
+	size_t size;
+	void (*update)(void __iomem *regs, int angle, u32 time_us);
+	bool irq;
+};
+
+struct fakefpga_device {
+	const struct fakefpga_type *type;
+	void __iomem *regs;
+	int irq; // software interrupt, 0 for none
+	struct platform_device *pdev;
+};
+
+/*
+ * @brief One sine per data word, phase shifted against each other.
+ */
+static void fakefpga_update_sensor(void __iomem *regs, int angle, u32 time_us)
+{
+	int i;
+
+	for (i = 0; i < SENSOR_REGS_SIZE / 4; i++)
+		writel(0x7fff + fixp_sin16(angle + i * 30), regs + i * 4);
+}
+
+/*
+ * @brief Big endian sines on all nine axes, the event fifo mirrors the
+ *        accel data. The timestamp goes last, the driver takes a new
+ *        timestamp as a new fifo entry.
+ */
+static void fakefpga_update_mpu(void __iomem *regs, int angle, u32 time_us)
+{
+	s16 value;
+	int i;
+
+	for (i = 0; i < MPU_AXES; i++) {
+		value = fixp_sin16(angle + i * 40);
+		writeb(value >> 8, regs + 2 * i);
+		writeb(value & 0xff, regs + 2 * i + 1);
+	}
+
+	for (i = 0; i < 6; i++)
+		writeb(readb(regs + i), regs + MPU_EVENT_REGS_OFFSET + i);
+
+	for (i = 0; i < sizeof(time_us); i++) {
+		writeb(time_us >> (8 * i), regs + MPU_TIME_OFFSET + i);
+		writeb(time_us >> (8 * i), regs + MPU_EVENT_REGS_OFFSET +
+		       MPU_EVENT_TIME_OFFSET + i);
+	}
+}
+
+static const struct fakefpga_type fakefpga_types[] = {
+	{
+		.name = "hdc",
+		.size = SENSOR_REGS_SIZE,
+		.update = fakefpga_update_sensor,
+	},
+	{
+		.name = "apds",
+		.size = SENSOR_REGS_SIZE,
+		.update = fakefpga_update_sensor,
+	},
+	{
+		.name = "mpu",
+		.size = MPU_REGS_SIZE,
+		.update = fakefpga_update_mpu,
+		.irq = true,
+	},
+	{
+		.name = "sevensegment",
+		.size = SEVENSEG_REGS_SIZE,
+	},
+};
+
+static struct fakefpga_device *fakefpga_devices;
+static unsigned int fakefpga_num_devices;
+static struct hrtimer fakefpga_timer;
+static ktime_t fakefpga_start;
+
+/*
+ * @brief Timer function, generates one sample on every device and
+ *        raises the software interrupts.
+ */
+static enum hrtimer_restart fakefpga_tick(struct hrtimer *timer)
+{
+	unsigned int rate = READ_ONCE(rate_hz);
+	unsigned int period = max(READ_ONCE(wave_period_ms), 1U);
+	ktime_t now = ktime_get();
+	u64 elapsed_ms = ktime_to_ms(ktime_sub(now, fakefpga_start));
+	struct fakefpga_device *dev;
+	int angle;
+	int i;
+
+	if (rate == 0) {
+		hrtimer_forward_now(timer, ns_to_ktime(IDLE_POLL_MS *
+						       NSEC_PER_MSEC));
+		return HRTIMER_RESTART;
+	}
+
+	angle = do_div(elapsed_ms, period) * 360 / period;
+
+	for (i = 0; i < fakefpga_num_devices; i++) {
+		dev = &fakefpga_devices[i];
+		if (dev->type->update)
+			dev->type->update(dev->regs, angle, ktime_to_us(now));
+	}
+
+	for (i = 0; i < fakefpga_num_devices; i++)
+		if (fakefpga_devices[i].irq)
+			generic_handle_irq(fakefpga_devices[i].irq);
+
+	hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / rate));
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * @brief Allocates a software interrupt, raised from the timer.
+ */
+static int fakefpga_irq_alloc(void)
+{
+	int irq;
+
+	irq = irq_alloc_desc(numa_node_id());
+	if (irq < 0)
+		return irq;
+	irq_set_chip_and_handler(irq, &dummy_irq_chip, handle_simple_irq);
+	irq_modify_status(irq, IRQ_NOREQUEST, IRQ_NOPROBE);
+
+	return irq;
+}
+
+/*
+ * @brief Allocates the register block and interrupt of a device and
+ *        registers it. Instances of a type get numbered automatically.
+ */
+static int fakefpga_add(struct fakefpga_device *dev)
+{
+	const struct fakefpga_type *type = dev->type;
+	struct fakefpga_platform_data pdata;
+	struct resource irq;
+	struct platform_device_info info = {
+		.name = type->name,
+		.id = PLATFORM_DEVID_AUTO,
+		.data = &pdata,
+		.size_data = sizeof(pdata),
+	};
+	int retval;
+
+	dev->regs = (void __force __iomem *)kzalloc(type->size, GFP_KERNEL);
+	if (dev->regs == NULL)
+		return -ENOMEM;
+
+	pdata.regs = dev->regs;
+	pdata.size = type->size;
+
+	// every instance gets its own line, like separate IPs would
+	if (type->irq) {
+		dev->irq = fakefpga_irq_alloc();
+		if (dev->irq < 0) {
+			retval = dev->irq;
+			goto err_free_regs;
+		}
+		irq = (struct resource)DEFINE_RES_IRQ(dev->irq);
+		info.res = &irq;
+		info.num_res = 1;
+	}
+
+	dev->pdev = platform_device_register_full(&info);
+	if (IS_ERR(dev->pdev)) {
+		retval = PTR_ERR(dev->pdev);
+		goto err_free_irq;
+	}
+
+	return 0;
+
+err_free_irq:
+	if (dev->irq > 0)
+		irq_free_desc(dev->irq);
+err_free_regs:
+	kfree((void __force *)dev->regs);
+	dev->irq = 0;
+	return retval;
+}
+
+static void fakefpga_del(struct fakefpga_device *dev)
+{
+	platform_device_unregister(dev->pdev);
+	if (dev->irq)
+		irq_free_desc(dev->irq);
+	kfree((void __force *)dev->regs);
+}
+
+static int __init fakefpga_init(void)
+{
+	int retval;
+	int i;
+
+	fakefpga_num_devices = ARRAY_SIZE(fakefpga_types) * max(instances, 1U);
+	fakefpga_devices = kcalloc(fakefpga_num_devices,
+				   sizeof(*fakefpga_devices), GFP_KERNEL);
+	if (fakefpga_devices == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < fakefpga_num_devices; i++) {
+		fakefpga_devices[i].type =
+			&fakefpga_types[i % ARRAY_SIZE(fakefpga_types)];
+		retval = fakefpga_add(&fakefpga_devices[i]);
+		if (retval)
+			goto err_del;
+	}
+
+	fakefpga_start = ktime_get();
+	hrtimer_init(&fakefpga_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	fakefpga_timer.function = fakefpga_tick;
+	hrtimer_start(&fakefpga_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+
+	pr_info(DRIVER_NAME ": %u devices, %u Hz\n", fakefpga_num_devices,
+		rate_hz);
+
+	return 0;
+
+err_del:
+	while (i--)
+		fakefpga_del(&fakefpga_devices[i]);
+	kfree(fakefpga_devices);
+	return retval;
+}
+
+static void __exit fakefpga_exit(void)
+{
+	int i;
+
+	hrtimer_cancel(&fakefpga_timer);
+	for (i = 0; i < fakefpga_num_devices; i++)
+		fakefpga_del(&fakefpga_devices[i]);
+	kfree(fakefpga_devices);
+}
+
+module_init(fakefpga_init);
+module_exit(fakefpga_exit);
+
+MODULE_AUTHOR("Giritzer");
+MODULE_DESCRIPTION("Software stand-in for the DE1-SoC FPGA design");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,56 @@
+/*
+ * Terasic DE1-SoC fake FPGA - platform data
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _FAKEFPGA_H
+#define _FAKEFPGA_H
+
+#include <linux/platform_device.h>
+#include <linux/io.h>
+#include <linux/err.h>
+
+/*
+ * Devices registered by the fake FPGA module carry this as platform
+ * data. Their registers live in RAM, there is nothing to ioremap.
+ */
+struct fakefpga_platform_data {
+	void __iomem *regs;
+	resource_size_t size;
+};
+
+/*
+ * @brief Maps the register block of a device, or hands out the block
+ *        of the fake FPGA if the device came from there.
+ */
+static inline void __iomem *fakefpga_ioremap(struct platform_device *pdev,
+					     int *size)
+{
+	struct fakefpga_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct resource *io;
+	void __iomem *regs;
+
+	if (pdata != NULL) {
+		*size = pdata->size;
+		return pdata->regs;
+	}
+
+	io = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	regs = devm_ioremap_resource(&pdev->dev, io);
+	if (!IS_ERR(regs))
+		*size = resource_size(io);
+
+	return regs;
+}
+
+#endif /* _FAKEFPGA_H */
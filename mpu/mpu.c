@@ -16,21 +16,56 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/of.h>
-#include <linux/of_irq.h>
 #include <linux/io.h>
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/interrupt.h>
 #include <linux/mutex.h>
 #include <linux/signal.h>
 #include <linux/sched.h> 
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/eventfd.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/regmap.h>
+#include <linux/rculist.h>
+#include <linux/pid.h>
+#include <linux/cred.h>
+#include <linux/security.h>
+#include <linux/debugfs.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/pm_qos.h>
+#include <linux/kfifo.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
 #include <asm/siginfo.h>	
+#include <asm/unaligned.h>
+
+#include "mpu.h"
+#include "fakefpga.h"
+
+#define CREATE_TRACE_POINTS
+#include "mpu_trace.h"
 
 #define DRIVER_NAME "mpu"
 
 // Array definitions
-#define CHAR_DEVICE_SIZE 22
+#define CHAR_DEVICE_SIZE MPU_RECORD_SIZE
 #define CONFIG_SIZE 21
 #define EVENT_OFFSET 15
 #define PID_OFFSET 16
@@ -38,6 +73,7 @@
 
 // Register definitions
 #define NUM_REGS 45
+#define NUM_AXES 9 // accel, gyro, mag, big endian s16 from offset 0
 #define CONFIG_OFFSET 22
 #define EVENT_REGS_OFFSET 37
 #define EVENT_REGS_SIZE 10
@@ -46,214 +82,2715 @@
 // custom signal
 #define SIG_TEST 44	
 
+// Sample ring defaults
+#define RING_SIZE 1024 // samples, rounded up to a power of two
+#define WAKEUP_WATERMARK 1 // samples
+#define WAKEUP_TIMEOUT_US 10000
+#define DRAIN_BUDGET 64 // fifo entries per irq thread pass
+
+// Interrupt/poll switching defaults
+#define POLL_RATE_HZ 2000 // interrupt rate that switches to polling
+#define POLL_INTERVAL_US 1000
+#define POLL_ENTER_IRQS 8 // consecutive interrupts above the rate
+#define BUSY_POLL_MAX_US 10000
+
+// Decimation
+#define DECIMATION_MAX 1024
+#define DECIMATION_QUEUE 64 // records, per decimating file
+#define IIR_FRAC 8 // fraction bits of the IIR states
+#define IIR_MAX_SHIFT 12
+
+// Sensor fusion, six axis Mahony filter in Q30 fixed point
+#define Q30 (1 << 30)
+#define CFG_GYRO_CONFIG 2 // GYRO_CONFIG, full scale select in bits 4:3
+#define GYRO_OFFSET 6 // gyro axes in a record
+#define GYRO_HALF_ANGLE 4688 // Q30 half angle per LSB and us at 131 LSB/dps, Q16
+#define FUSION_MAX_DT_US 100000 // longer gaps restart the integration
+#define FUSION_KP_MILLI 1000
+#define FUSION_KI_MILLI 0
+#define FUSION_MAX_GAIN_MILLI 10000
+#define FUSION_MAX_INTEGRAL (Q30 / 8) // rad/s
+
+// Packed output
+#define PACKED_KEYFRAME_INTERVAL 256 // records
+#define PACKED_MAX_INTERVAL 65535
+
+// Hardware clock, a free running 32 bit microsecond counter
+#define HW_TICK_NS 1000
+#define CLOCK_WINDOW 256 // samples per offset estimate
+#define CLOCK_DRIFT_WEIGHT 8 // 1/8 of a new drift estimate is taken
+#define CLOCK_MAX_DRIFT_PPB 1000000
+
+// Latency histogram, bucket n > 0 counts [2^(n+9), 2^(n+10)) ns
+#define LATENCY_BUCKETS 24
+
+enum {
+	MPU_LAT_SENSOR_IRQ, // hardware timestamp to interrupt entry
+	MPU_LAT_IRQ_READER, // interrupt entry to read()
+	MPU_LAT_SENSOR_READER, // hardware timestamp to read()
+	MPU_LAT_STAGES,
+};
+
+static const char * const mpu_lat_names[MPU_LAT_STAGES] = {
+	"sensor_irq", "irq_reader", "sensor_reader",
+};
+
+/*
+ * Maps the hardware timestamps to CLOCK_MONOTONIC. The offset is the
+ * smallest difference between the time a sample was read and its
+ * hardware time seen in a window of samples, the drift follows from
+ * the offsets of consecutive windows.
+ */
+struct mpu_clock {
+	u32 last_hw; // counter value of the newest sample
+	u64 hw_ns; // extended to 64 bit, in ns
+	s64 offset_ns; // CLOCK_MONOTONIC - hardware time at ref_ns
+	u64 ref_ns; // hardware time the offset belongs to
+	s64 drift_ppb;
+	unsigned int windows; // estimates made so far
+
+	// window in progress
+	s64 win_min;
+	u64 win_ns;
+	unsigned int win_count;
+};
+
+struct mpu_latency {
+	u64 count[MPU_LAT_STAGES][LATENCY_BUCKETS];
+};
+
+/*
+ * State of the Mahony filter, quaternion and integral feedback.
+ */
+struct mpu_fusion {
+	s32 q[4]; // w, x, y, z
+	s32 integral[3]; // gyro bias estimate, rad/s
+	u32 last_hw; // hardware timestamp of the previous sample
+	bool started;
+};
+
+// element of the decimation queues
+union mpu_output {
+	struct mpu_ring_record raw;
+	struct mpu_quat_record quat;
+};
+
+/*
+ * Decimation and low pass filter of one subscriber. The irq thread
+ * feeds it every sample and queues every factor-th output for the
+ * reader. Settings and filter state change under the file lock and
+ * fifo_lock, the queue is allocated once and kept until release.
+ */
+struct mpu_decimator {
+	unsigned int factor; // 0 reads the shared ring
+	unsigned int filter; // MPU_FILTER_*
+	unsigned int shift; // IIR coefficient 2^-shift
+	unsigned int phase; // inputs since the last output
+	bool primed; // IIR states hold a sample
+	s32 acc[NUM_AXES]; // FIR sums or IIR states
+	DECLARE_KFIFO_PTR(queue, union mpu_output);
+};
+
+static DEFINE_IDA(mpu_ida);
 
+static unsigned int ring_size = RING_SIZE;
+module_param(ring_size, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Number of samples buffered per device");
 
 struct altera_mpu {
 	void *regs;
-	char buffer[CHAR_DEVICE_SIZE];
-	char config_buffer[CONFIG_SIZE];
+	struct regmap *map;
+	struct mutex config_lock;
 	int size;
-	int pid;
 	int irq_num;
 	bool event;
 	struct miscdevice misc;
+	int id; // instance number, misc device mpu<id>
+
+	// held by the device, every open file and every mapping. The
+	// registers are gone once dead is set, under fifo_lock and
+	// config_lock, the ring stays until the last reference.
+	struct kref ref;
+	bool dead;
+
+	// sample ring, filled by the irq thread. read() copies records
+	// out under seq, every open file has its own position. A mapped
+	// ring is consumed by userspace and flow controlled by hdr->tail.
+	void *ring;
+	size_t ring_bytes;
+	struct mpu_ring_header *hdr;
+	struct mpu_ring_record *records;
+	u32 *delays; // hardware timestamp to record timestamp, in ns
+	u32 ring_mask;
+	u32 head; // private copy, hdr->head is writable by userspace
+	seqcount_t seq;
+	u32 flush_head; // files positioned before this skip ahead
+	atomic_t mapped; // vmas mapping the ring
+	struct hrtimer wakeup_timer;
+	unsigned int wakeup_watermark; // default of the subscribers
+	unsigned int wakeup_timeout_us;
+
+	// fifo draining
+	struct mutex fifo_lock;
+	unsigned int drain_budget;
+	u32 last_time; // hardware timestamp of the newest sample
+	struct mpu_clock clock;
+
+	// sensor fusion, run by the irq thread while files read quaternions
+	atomic_t fusion_users;
+	struct mpu_fusion fusion; // under fifo_lock
+	s32 (*quats)[4]; // orientation after each record of the ring
+	unsigned int fusion_kp_milli;
+	unsigned int fusion_ki_milli;
+	unsigned int gyro_fs; // GYRO_CONFIG bits 4:3, set with the config
+
+	// polling, the irq thread disables the interrupt while it polls
+	bool polling;
+	bool stopping; // lets the irq thread return for free_irq()
+	unsigned int poll_rate_hz; // 0 never polls
+	unsigned int poll_interval_us;
+	unsigned int fast_irqs; // consecutive interrupts above the rate
+	u64 last_irq_ns;
+
+	// open files, walked under RCU by the irq thread and the timer
+	struct list_head subscribers;
+	struct mutex subscribers_lock; // open, release and flush
+
+	// statistics, exported to debugfs
+	struct dentry *debugfs;
+	atomic64_t irq_ns; // hard irq entry of the newest interrupt
+	u64 stat_interrupts;
+	u64 stat_samples; // taken from the fifo
+	u64 stat_drops; // not stored, mapped ring full
+	u64 stat_max_wakeup_ns; // irq or timer expiry to notification
+	u64 stat_polls;
+	u64 stat_poll_entries;
+	atomic64_t stat_skipped; // lost by readers lapped by the ring
+	atomic64_t stat_bytes_read;
+	atomic64_t stat_mmio_ns;
+	atomic64_t stat_busy_polls; // blocking reads served by spinning
+	atomic64_t stat_filtered; // samples dropped by BPF filters
+	struct mpu_latency __percpu *latency;
+};
+
+/*
+ * Encoder state of a packing file, the values of the previous record
+ * handed out.
+ */
+struct mpu_packer {
+	u32 channels; // MPU_PACK_*, 0 turns packing off
+	u32 interval; // records per keyframe
+	u32 countdown; // records until the next keyframe
+	u64 last_timestamp;
+	s64 timestamp_delta;
+	u32 last_hw;
+	s32 hw_delta;
+	s16 last[NUM_AXES];
 };
 
+/*
+ * Signal target of a subscriber. The credentials of the task that set
+ * it are checked on every send, the sender is the irq thread, the
+ * wakeup timer or an unrelated reader.
+ */
+struct mpu_signal {
+	struct pid *pid;
+	const struct cred *cred;
+	u32 secid;
+	int signo;
+};
 
 /*
- * @brief IRQ handler function.
+ * Per open file state. Every open file is a subscriber with its own
+ * read position, notification targets and filter.
  */
-static irqreturn_t irq_handler(int irq, void *dev_id)
-{
-	struct altera_mpu *mpu = dev_id;
-	struct siginfo info;
-   	struct task_struct *t;
+struct mpu_file {
+	struct altera_mpu *mpu;
+	struct list_head node;
+	struct mutex lock; // serializes reads and target changes
+	u32 cursor; // index of the next record to read
+	wait_queue_head_t wait;
 
-        t = pid_task(find_vpid(mpu->pid), PIDTYPE_PID);
-	if(t == NULL)
-		return IRQ_HANDLED;
+	// notification targets, replaced under lock, used under RCU
+	struct eventfd_ctx __rcu *eventfd;
+	struct mpu_signal __rcu *signal;
 
-	memset(&info, 0, sizeof(struct siginfo));
-	info.si_signo = SIG_TEST;
-	info.si_code = SI_QUEUE;
-	info.si_int = 1234;  
+	// filter, 0 selects the device default or disables it
+	unsigned int watermark;
+	unsigned int motion_threshold;
+	s16 last_accel[3]; // of the newest sample that passed
+	bool have_accel;
 
-	/* Tell userspace that IRQ occured */
-	send_sig_info(SIG_TEST, &info, t);
+	atomic_t pending; // samples passed but not yet notified
+	atomic_t notify_seq; // incremented on every notification
+	int read_seq; // notify_seq the last read() caught up with
 
-	return IRQ_HANDLED;
-}
+	// busy polling, changed under lock
+	unsigned int busy_poll_us;
+	struct pm_qos_request qos;
+
+	struct mpu_decimator decim;
+	u32 record_type; // MPU_RECORD_*, changed under lock and fifo_lock
+	struct mpu_packer packer; // under lock
+
+	// BPF filter and the skb it sees the samples in, changed under
+	// lock and fifo_lock
+	struct bpf_prog *prog;
+	struct sk_buff *skb;
+};
 
 /*
- * @brief This function gets executed on fread.
+ * @brief Reads the current record of the streaming or event fifo.
  */
-static int mpu_read(struct file *filep, char *buf, size_t count,
-			 loff_t *offp)
+static void mpu_fetch_sample(struct altera_mpu *mpu, u8 *data)
 {
-	char tmp[CHAR_DEVICE_SIZE];
+	char tmp[EVENT_REGS_SIZE];
 	int i = 0;
-	struct altera_mpu *mpu = container_of(filep->private_data,
-					   struct altera_mpu, misc);
-
-	if ((*offp < 0) || (*offp >= CHAR_DEVICE_SIZE))
-		return 0;
 
-	if ((*offp + count) > CHAR_DEVICE_SIZE)
-		count = CHAR_DEVICE_SIZE - *offp;
-
-	if (count > 0) {
-		if(mpu->event)
+	if(mpu->event)
+	{
+		// get data form event fifo
+		regmap_bulk_read(mpu->map, EVENT_REGS_OFFSET, tmp,
+				 EVENT_REGS_SIZE);
+		// copy accel data
+		for(i = 0; i < CHAR_DEVICE_SIZE; i++)
 		{
-			// get data form event fifo
-        		memcpy_fromio(tmp, mpu->regs + EVENT_REGS_OFFSET, EVENT_REGS_SIZE);
-			// copy accel data
-			for(i = 0; i < CHAR_DEVICE_SIZE; i++)
+			if(i < EVENT_TIME_OFFSET - 1)
 			{
-				if(i < EVENT_TIME_OFFSET - 1)
-				{
-					mpu->buffer[i] = tmp[i];
-				}
-				else
-				{
-					mpu->buffer[i] = '\0'; // set all other sensor data zero
-				}
+				data[i] = tmp[i];
 			}
-
-			// copy timestamp
-			for(i = 0; i <= EVENT_REGS_SIZE - EVENT_TIME_OFFSET; i++)
+			else
 			{
-				mpu->buffer[TIME_OFFSET - 1 + i] = tmp[EVENT_TIME_OFFSET - 1 + i];
+				data[i] = '\0'; // set all other sensor data zero
 			}
-
 		}
-		else
+
+		// copy timestamp
+		for(i = 0; i <= EVENT_REGS_SIZE - EVENT_TIME_OFFSET; i++)
 		{
-			// copy all data from streaming fifo
-     			memcpy_fromio(mpu->buffer, mpu->regs, CHAR_DEVICE_SIZE);
+			data[TIME_OFFSET - 1 + i] = tmp[EVENT_TIME_OFFSET - 1 + i];
+		}
+	}
+	else
+	{
+		// copy all data from streaming fifo
+		regmap_bulk_read(mpu->map, 0, data, CHAR_DEVICE_SIZE);
+	}
+}
+
+/*
+ * @brief Allocates the sample ring, header page first, records after.
+ */
+static int mpu_ring_alloc(struct altera_mpu *mpu, unsigned int size)
+{
+	size = roundup_pow_of_two(size);
+
+	mpu->ring_bytes = PAGE_SIZE +
+		PAGE_ALIGN(size * sizeof(struct mpu_ring_record));
+	mpu->ring = vmalloc_user(mpu->ring_bytes);
+	if (mpu->ring == NULL)
+		return -ENOMEM;
+
+	mpu->delays = vzalloc(size * sizeof(*mpu->delays));
+	if (mpu->delays == NULL)
+		goto err_free_ring;
+
+	mpu->quats = vzalloc(size * sizeof(*mpu->quats));
+	if (mpu->quats == NULL)
+		goto err_free_delays;
+
+	mpu->hdr = mpu->ring;
+	mpu->records = mpu->ring + PAGE_SIZE;
+	mpu->ring_mask = size - 1;
+	mpu->head = 0;
+
+	mpu->hdr->version = MPU_RING_VERSION;
+	mpu->hdr->size = size;
+	mpu->hdr->record_size = sizeof(struct mpu_ring_record);
+	mpu->hdr->data_offset = PAGE_SIZE;
+
+	return 0;
+
+err_free_delays:
+	vfree(mpu->delays);
+	mpu->delays = NULL;
+err_free_ring:
+	vfree(mpu->ring);
+	mpu->ring = NULL;
+	return -ENOMEM;
+}
+
+static void mpu_ring_free(struct altera_mpu *mpu)
+{
+	vfree(mpu->quats);
+	vfree(mpu->delays);
+	vfree(mpu->ring);
+}
+
+/*
+ * @brief Frees the device state once the device, the last open file and
+ *        the last mapping of the ring let go of it.
+ */
+static void mpu_free(struct kref *ref)
+{
+	struct altera_mpu *mpu = container_of(ref, struct altera_mpu, ref);
+
+	mpu_ring_free(mpu);
+	free_percpu(mpu->latency);
+	kfree(mpu->misc.name);
+	kfree(mpu);
+}
+
+/*
+ * @brief Stores a record in the ring and publishes it, to read() under
+ *        the seqcount and to the mapped ring through hdr->head.
+ */
+static void mpu_ring_push(struct altera_mpu *mpu,
+			  const struct mpu_ring_record *rec, u32 delay)
+{
+	// readers spin while a write is in progress, keep it short
+	preempt_disable();
+	write_seqcount_begin(&mpu->seq);
+	mpu->records[mpu->head & mpu->ring_mask] = *rec;
+	mpu->delays[mpu->head & mpu->ring_mask] = delay;
+	WRITE_ONCE(mpu->head, mpu->head + 1);
+	write_seqcount_end(&mpu->seq);
+	preempt_enable();
+
+	smp_store_release(&mpu->hdr->head, mpu->head);
+}
+
+/*
+ * @brief Copies the record with the given index out of the ring. Lock
+ *        free, the copy is retried if the irq thread wrote meanwhile.
+ *
+ *        delay is the time from the hardware timestamp to the record
+ *        timestamp.
+ *
+ * @return false if the record is not (or no longer) in the ring.
+ */
+static bool mpu_ring_get(struct altera_mpu *mpu, u32 index,
+			 struct mpu_ring_record *rec, u32 *delay)
+{
+	unsigned int seq;
+	bool valid;
+
+	do {
+		seq = read_seqcount_begin(&mpu->seq);
+		valid = mpu->head - index - 1 <= mpu->ring_mask;
+		if (valid) {
+			*rec = mpu->records[index & mpu->ring_mask];
+			*delay = mpu->delays[index & mpu->ring_mask];
 		}
+	} while (read_seqcount_retry(&mpu->seq, seq));
 
-		// hand data to userspace
-		count = count - copy_to_user(buf,
-					     mpu->buffer + *offp,
-					     count);
+	return valid;
+}
 
-		*offp += count;
+/*
+ * @brief Returns the read position of a file relative to head, moved
+ *        past flushed records and records the ring no longer holds.
+ *        The number of the latter is stored in lapped, if given.
+ */
+static u32 mpu_file_cursor(struct mpu_file *file, u32 head,
+			   unsigned int *lapped)
+{
+	struct altera_mpu *mpu = file->mpu;
+	u32 flushed = READ_ONCE(mpu->flush_head);
+	u32 cursor = READ_ONCE(file->cursor);
+
+	if ((s32)(flushed - cursor) > 0)
+		cursor = flushed;
+	if (head - cursor > mpu->ring_mask + 1) {
+		if (lapped != NULL)
+			*lapped = head - mpu->ring_mask - 1 - cursor;
+		cursor = head - mpu->ring_mask - 1;
 	}
-	return count;
+
+	return cursor;
 }
 
 /*
- * @brief This function gets executed on fwrite.
+ * @brief Returns true if a blocked reader should be woken up, i.e. the
+ *        file got notified since it last caught up and there is data.
  */
-static int mpu_write(struct file *filep, const char *buf,
-			  size_t count, loff_t *offp)
+static bool mpu_data_ready(struct mpu_file *file)
 {
-	int i = 0;
-	int result = 0;
-        char values_to_write[CONFIG_SIZE];
-	char tmp[CONFIG_SIZE+1];
-	struct altera_mpu *mpu = container_of(filep->private_data,
-					   struct altera_mpu, misc);
+	u32 head = READ_ONCE(file->mpu->head);
 
-	if ((*offp < 0) || (*offp >= CONFIG_SIZE))
-		return -EINVAL;
+	if (READ_ONCE(file->decim.factor)) {
+		if (kfifo_is_empty(&file->decim.queue))
+			return false;
+	} else if (head == mpu_file_cursor(file, head, NULL)) {
+		return false;
+	}
 
-	if ((*offp + count) > CONFIG_SIZE)
-		count = CONFIG_SIZE - *offp;
-
-	if (count > 0) {
-		count = count - copy_from_user(tmp + *offp,
-					       buf,
-					       count);
-	}
-
-        // value to write
-        for (i = 0; i < CONFIG_SIZE; i++)
-        {
-	   // if value is not zero update
-	   if(tmp[i] != '\0')
-	   {
-		mpu->config_buffer[i] = tmp[i];
-		values_to_write[i] = mpu->config_buffer[i];
-           }
-	   else // use old value otherwise
-	  {
-		values_to_write[i] = mpu->config_buffer[i];
-	  }
-        }
-	memcpy_toio(mpu->regs + CONFIG_OFFSET, values_to_write, EVENT_REGS_OFFSET - CONFIG_OFFSET);
-	tmp[CONFIG_SIZE] = '\0';
-	if(tmp[EVENT_OFFSET] == '1')
-	{	mpu->event = true; }
-	else
-	{	mpu->event = false;}
+	return atomic_read(&file->notify_seq) != READ_ONCE(file->read_seq);
+}
 
-	// for convenience
-	for(i = PID_OFFSET; i < CONFIG_SIZE;i++)
-		if(tmp[i] < '0' || tmp[i] > '9')
-			tmp[i] = '\0';
-	
-	// set PID
-	result = kstrtoint(&tmp[PID_OFFSET], 10, &mpu->pid);
-	printk("PID set: %d\n", mpu->pid);
+/*
+ * @brief Tells a subscriber that count new samples are available: wakes
+ *        up its readers, signals its eventfd and sends its signal.
+ *        Called under rcu_read_lock(), since_ns is the time of the irq
+ *        or timer expiry the notification is sent for.
+ */
+static void mpu_notify(struct mpu_file *file, unsigned int count,
+		       u64 since_ns)
+{
+	struct altera_mpu *mpu = file->mpu;
+	u64 latency = ktime_get_ns() - since_ns;
+	struct eventfd_ctx *ctx;
+	struct mpu_signal *sig;
+	struct siginfo info;
+
+	// irq thread and timer race here, good enough for a statistic
+	if (latency > READ_ONCE(mpu->stat_max_wakeup_ns))
+		WRITE_ONCE(mpu->stat_max_wakeup_ns, latency);
+	trace_mpu_notify(mpu->misc.name, count, latency);
+
+	atomic_inc(&file->notify_seq);
+	wake_up_interruptible(&file->wait);
+
+	ctx = rcu_dereference(file->eventfd);
+	if (ctx != NULL)
+		eventfd_signal(ctx, count);
+
+	sig = rcu_dereference(file->signal);
+	if (sig != NULL) {
+		memset(&info, 0, sizeof(struct siginfo));
+		info.si_signo = sig->signo;
+		info.si_code = SI_QUEUE;
+		info.si_int = 1234;
+
+		kill_pid_info_as_cred(sig->signo, &info, sig->pid, sig->cred,
+				      sig->secid);
+	}
+}
+
+/*
+ * @brief Timer function, flushes notifications held back below the
+ *        watermark once the oldest of them waited wakeup_timeout_us.
+ */
+static enum hrtimer_restart mpu_wakeup_timeout(struct hrtimer *timer)
+{
+	struct altera_mpu *mpu = container_of(timer, struct altera_mpu,
+					      wakeup_timer);
+	u64 expires = ktime_to_ns(hrtimer_get_expires(timer));
+	struct mpu_file *file;
+	unsigned int pending;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(file, &mpu->subscribers, node) {
+		pending = atomic_xchg(&file->pending, 0);
+		if (pending)
+			mpu_notify(file, pending, expires);
+	}
+	rcu_read_unlock();
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * @brief Motion filter, true if an accel axis moved by more than the
+ *        threshold since the last sample that passed.
+ */
+static bool mpu_file_moved(struct mpu_file *file, unsigned int threshold,
+			   const u8 *data)
+{
+	bool moved = !file->have_accel;
+	s16 accel[3];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		accel[i] = get_unaligned_be16(data + 2 * i);
+		if (abs(accel[i] - file->last_accel[i]) > threshold)
+			moved = true;
+	}
+
+	if (moved) {
+		memcpy(file->last_accel, accel, sizeof(accel));
+		file->have_accel = true;
+	}
+
+	return moved;
+}
+
+/*
+ * @brief Feeds a sample into a decimator.
+ *
+ * @return true if an output record was produced into out.
+ */
+static bool mpu_decimator_feed(struct mpu_decimator *d,
+			       const struct mpu_ring_record *rec,
+			       struct mpu_ring_record *out)
+{
+	s32 x, y;
+	int i;
+
+	for (i = 0; i < NUM_AXES; i++) {
+		x = (s16)get_unaligned_be16(rec->data + 2 * i);
+		switch (d->filter) {
+		case MPU_FILTER_FIR:
+			d->acc[i] += x;
+			break;
+		case MPU_FILTER_IIR:
+			x *= 1 << IIR_FRAC;
+			if (d->primed)
+				d->acc[i] += (x - d->acc[i]) >> d->shift;
+			else
+				d->acc[i] = x;
+			break;
+		default:
+			d->acc[i] = x;
+			break;
+		}
+	}
+	d->primed = true;
+
+	if (++d->phase < d->factor)
+		return false;
+	d->phase = 0;
+
+	*out = *rec;
+	for (i = 0; i < NUM_AXES; i++) {
+		switch (d->filter) {
+		case MPU_FILTER_FIR:
+			// moving average over the decimation window
+			y = DIV_ROUND_CLOSEST(d->acc[i], (s32)d->factor);
+			d->acc[i] = 0;
+			break;
+		case MPU_FILTER_IIR:
+			y = (d->acc[i] + (1 << (IIR_FRAC - 1))) >> IIR_FRAC;
+			break;
+		default:
+			y = d->acc[i];
+			break;
+		}
+		put_unaligned_be16(clamp_t(s32, y, S16_MIN, S16_MAX),
+				   out->data + 2 * i);
+	}
+
+	return true;
+}
+
+/*
+ * @brief Fills the quaternion record of the ring record index.
+ */
+static void mpu_quat_output(struct altera_mpu *mpu, u32 index,
+			    struct mpu_quat_record *out)
+{
+	const struct mpu_ring_record *rec = &mpu->records[index & mpu->ring_mask];
+
+	out->timestamp = rec->timestamp;
+	memcpy(out->q, mpu->quats[index & mpu->ring_mask], sizeof(out->q));
+	memcpy(&out->hw_time, &rec->data[TIME_OFFSET - 1], sizeof(out->hw_time));
+	out->reserved = 0;
+}
+
+/*
+ * @brief Runs the BPF filter of a file on a record. The program
+ *        returns 0 to drop it or the number of bytes to keep.
+ *
+ * @return false if the record is dropped, else the kept part in out.
+ */
+static bool mpu_filter_run(struct mpu_file *file,
+			   const struct mpu_ring_record *rec,
+			   struct mpu_ring_record *out)
+{
+	unsigned int keep;
+
+	memcpy(file->skb->data, rec->data, CHAR_DEVICE_SIZE);
+	keep = BPF_PROG_RUN(file->prog, file->skb);
+	if (keep == 0) {
+		atomic64_inc(&file->mpu->stat_filtered);
+		return false;
+	}
+
+	*out = *rec;
+	if (keep < CHAR_DEVICE_SIZE)
+		memset(out->data + keep, 0, CHAR_DEVICE_SIZE - keep);
+
+	return true;
+}
+
+/*
+ * @brief Decimates the records [start, end) into the queue of a file.
+ *        Outputs that do not fit into the queue are dropped, as are
+ *        records the BPF filter drops.
+ *
+ * @return Number of outputs that passed the motion filter.
+ */
+static unsigned int mpu_decimate(struct mpu_file *file, u32 start, u32 end,
+				 unsigned int threshold)
+{
+	struct altera_mpu *mpu = file->mpu;
+	struct mpu_decimator *d = &file->decim;
+	const struct mpu_ring_record *rec;
+	struct mpu_ring_record kept;
+	const u8 *accel;
+	union mpu_output out;
+	unsigned int count = 0;
+	u32 i;
+
+	for (i = start; i != end; i++) {
+		rec = &mpu->records[i & mpu->ring_mask];
+		if (file->prog) {
+			if (!mpu_filter_run(file, rec, &kept))
+				continue;
+			rec = &kept;
+		}
+
+		if (file->record_type == MPU_RECORD_QUAT) {
+			if (++d->phase < d->factor)
+				continue;
+			d->phase = 0;
+			mpu_quat_output(mpu, i, &out.quat);
+			accel = rec->data;
+		} else {
+			if (!mpu_decimator_feed(d, rec, &out.raw))
+				continue;
+			accel = out.raw.data;
+		}
+
+		if (!kfifo_put(&d->queue, out)) {
+			atomic64_inc(&mpu->stat_skipped);
+			continue;
+		}
+		if (!threshold || mpu_file_moved(file, threshold, accel))
+			count++;
+	}
 
-	*offp += count;
 	return count;
 }
 
-static const struct file_operations mpu_fops = {
-	.owner = THIS_MODULE,
-	.read = mpu_read,
-	.write = mpu_write,
-};
+/*
+ * @brief Runs the records [start, end) through the filter of a
+ *        subscriber and notifies it once its watermark is reached.
+ *        Called from the irq thread with fifo_lock and rcu_read_lock
+ *        held, irq_ns is the hard irq entry of this pass.
+ *
+ * @return true if samples are held back below the watermark.
+ */
+static bool mpu_file_update(struct mpu_file *file, u32 start, u32 end,
+			    u64 irq_ns)
+{
+	struct altera_mpu *mpu = file->mpu;
+	unsigned int threshold = READ_ONCE(file->motion_threshold);
+	unsigned int watermark = READ_ONCE(file->watermark);
+	unsigned int count = end - start;
+	unsigned int pending;
+	u32 i;
 
-static int mpu_probe(struct platform_device *pdev)
+	if (file->decim.factor) {
+		count = mpu_decimate(file, start, end, threshold);
+	} else if (threshold) {
+		count = 0;
+		for (i = start; i != end; i++)
+			if (mpu_file_moved(file, threshold,
+					   mpu->records[i & mpu->ring_mask].data))
+				count++;
+	}
+	if (count == 0)
+		return atomic_read(&file->pending) != 0;
+
+	if (watermark == 0)
+		watermark = READ_ONCE(mpu->wakeup_watermark);
+
+	pending = atomic_add_return(count, &file->pending);
+	if (pending < watermark)
+		return true;
+
+	pending = atomic_xchg(&file->pending, 0);
+	if (pending)
+		mpu_notify(file, pending, irq_ns);
+
+	return false;
+}
+
+/*
+ * @brief Counts a latency in the histogram of a stage.
+ */
+static void mpu_latency_add(struct altera_mpu *mpu, int stage, u64 ns)
 {
-	struct altera_mpu *mpu;
-	struct resource *io;
-	int retval;
+	unsigned int bucket = min_t(unsigned int, fls64(ns >> 10),
+				    LATENCY_BUCKETS - 1);
 
-	mpu = devm_kzalloc(&pdev->dev, sizeof(*mpu), GFP_KERNEL);
-	if (mpu == NULL)
-		return -ENOMEM;
-	platform_set_drvdata(pdev, mpu);
+	this_cpu_inc(mpu->latency->count[stage][bucket]);
+}
 
-	io = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	mpu->regs = devm_ioremap_resource(&pdev->dev, io);
-	if (IS_ERR(mpu->regs))
-		return PTR_ERR(mpu->regs);
-	mpu->size = io->end - io->start + 1;
+/*
+ * @brief Converts an extended hardware time to CLOCK_MONOTONIC.
+ */
+static u64 mpu_clock_to_mono(const struct mpu_clock *clk, u64 hw_ns)
+{
+	s64 elapsed_us;
 
+	// no estimate yet, use the window in progress
+	if (clk->windows == 0)
+		return hw_ns + clk->win_min;
 
-	mpu->misc.name = DRIVER_NAME;
-	mpu->misc.minor = MISC_DYNAMIC_MINOR;
-	mpu->misc.fops = &mpu_fops;
-	mpu->misc.parent = &pdev->dev;
-	retval = misc_register(&mpu->misc);
+	elapsed_us = (s64)div_u64(hw_ns - clk->ref_ns, NSEC_PER_USEC);
+	return hw_ns + clk->offset_ns +
+		div_s64(elapsed_us * clk->drift_ppb, USEC_PER_SEC);
+}
 
-	mpu->irq_num = irq_of_parse_and_map(pdev->dev.of_node, 0);
+/*
+ * @brief Feeds the hardware timestamp of a sample and the time it was
+ *        read into the estimate. Called with fifo_lock held.
+ *
+ * @return The sample time in CLOCK_MONOTONIC.
+ */
+static u64 mpu_clock_update(struct mpu_clock *clk, u32 hw, u64 seen_ns)
+{
+	s64 observed, drift;
+	u64 span;
 
-	retval = devm_request_irq(&pdev->dev, mpu->irq_num, irq_handler,
-				  IRQF_SHARED,
-				  DRIVER_NAME, mpu);
+	// the counter went backwards, the FPGA got reset
+	if ((s32)(hw - clk->last_hw) < 0) {
+		memset(clk, 0, sizeof(*clk));
+		clk->hw_ns = (u64)hw * HW_TICK_NS;
+	} else {
+		clk->hw_ns += (u64)(hw - clk->last_hw) * HW_TICK_NS;
+	}
+	clk->last_hw = hw;
 
-	if (retval) {
-		dev_err(&pdev->dev, "Register misc device failed!\n");
-		return retval;
+	observed = seen_ns - clk->hw_ns;
+	if (clk->win_count == 0 || observed < clk->win_min) {
+		clk->win_min = observed;
+		clk->win_ns = clk->hw_ns;
 	}
 
-	dev_info(&pdev->dev, "mpu driver loaded!");
+	if (++clk->win_count >= CLOCK_WINDOW) {
+		span = clk->win_ns - clk->ref_ns;
+		if (clk->windows && span) {
+			drift = div64_s64((clk->win_min - clk->offset_ns) *
+					  NSEC_PER_SEC, span);
+			drift = clamp_t(s64, drift, -CLOCK_MAX_DRIFT_PPB,
+					CLOCK_MAX_DRIFT_PPB);
+			if (clk->windows == 1)
+				clk->drift_ppb = drift;
+			else
+				clk->drift_ppb += div_s64(drift - clk->drift_ppb,
+							  CLOCK_DRIFT_WEIGHT);
+		}
+		clk->offset_ns = clk->win_min;
+		clk->ref_ns = clk->win_ns;
+		clk->windows++;
+		clk->win_count = 0;
+	}
 
-	return 0;
+	return mpu_clock_to_mono(clk, clk->hw_ns);
 }
 
-static int mpu_remove(struct platform_device *pdev)
+/*
+ * @brief Moves all pending entries of the hardware fifo into the ring.
+ *        The fifo has no fill level register, it is empty once it hands
+ *        out the same hardware timestamp again.
+ *
+ *        Samples are stamped with irq_ns, the entry of the interrupt
+ *        that announced them, unless they arrived after it.
+ *
+ * @return Number of samples taken from the fifo.
+ */
+static unsigned int mpu_drain_fifo(struct altera_mpu *mpu, u64 irq_ns)
 {
-	struct altera_mpu *mpu = platform_get_drvdata(pdev);
+	struct mpu_ring_record rec = { 0 };
+	u64 start = ktime_get_ns();
+	unsigned int dropped = 0;
+	unsigned int count = 0;
+	u64 mmio = 0;
+	u64 issued, fetched, sensor;
+	u32 tail;
+	u32 time;
 
-	misc_deregister(&mpu->misc);
+	while (count < mpu->drain_budget) {
+		issued = ktime_get_ns();
+		mpu_fetch_sample(mpu, rec.data);
+		fetched = ktime_get_ns();
+		mmio += fetched - issued;
 
-	platform_set_drvdata(pdev, NULL);
+		memcpy(&time, &rec.data[TIME_OFFSET - 1], sizeof(time));
+		if (time == mpu->last_time)
+			break;
+		mpu->last_time = time;
+		count++;
+
+		sensor = mpu_clock_update(&mpu->clock, time, fetched);
+		rec.timestamp = sensor <= irq_ns ? irq_ns : fetched;
+		if (sensor < rec.timestamp)
+			mpu_latency_add(mpu, MPU_LAT_SENSOR_IRQ,
+					rec.timestamp - sensor);
+
+		if (atomic_read(&mpu->mapped)) {
+			// keep what the mmap consumer has not seen yet
+			tail = smp_load_acquire(&mpu->hdr->tail);
+			if (mpu->head - tail > mpu->ring_mask) {
+				mpu->hdr->overflows++;
+				dropped++;
+				continue;
+			}
+		}
+
+		mpu_ring_push(mpu, &rec, sensor < rec.timestamp ?
+			      min_t(u64, rec.timestamp - sensor, U32_MAX) : 0);
+	}
+
+	mpu->stat_samples += count;
+	mpu->stat_drops += dropped;
+	atomic64_add(mmio, &mpu->stat_mmio_ns);
+	trace_mpu_drain(mpu->misc.name, count, dropped, mmio,
+			ktime_get_ns() - start);
+
+	return count;
+}
+
+/*
+ * @brief IRQ handler function, defers all work to the irq thread.
+ */
+static irqreturn_t irq_handler(int irq, void *dev_id)
+{
+	struct altera_mpu *mpu = dev_id;
+
+	atomic64_set(&mpu->irq_ns, ktime_get_ns());
+	mpu->stat_interrupts++;
+	trace_mpu_irq(mpu->misc.name, irq);
+
+	return IRQ_WAKE_THREAD;
+}
+
+static inline s32 q30_mul(s32 a, s32 b)
+{
+	return ((s64)a * b) >> 30;
+}
+
+/*
+ * @brief Starts the orientation over from the identity.
+ */
+static void mpu_fusion_reset(struct mpu_fusion *f)
+{
+	memset(f, 0, sizeof(*f));
+	f->q[0] = Q30;
+}
+
+/*
+ * @brief Runs one sample through the Mahony filter: the gyro rates,
+ *        corrected by the angle between the measured and the estimated
+ *        gravity, are integrated into the quaternion. Called with
+ *        fifo_lock held.
+ */
+static void mpu_fusion_update(struct altera_mpu *mpu, const u8 *data,
+			      s32 *quat)
+{
+	struct mpu_fusion *f = &mpu->fusion;
+	unsigned int kp = READ_ONCE(mpu->fusion_kp_milli);
+	unsigned int ki = READ_ONCE(mpu->fusion_ki_milli);
+	s32 a[3], v[3], e[3], h[3], dq[4];
+	s32 *q = f->q;
+	unsigned long mag2 = 0;
+	u32 hw, dt, norm;
+	s64 n2, scale;
+	int fs, i;
+
+	memcpy(&hw, &data[TIME_OFFSET - 1], sizeof(hw));
+	dt = hw - f->last_hw;
+	f->last_hw = hw;
+	if (!f->started || dt == 0 || dt > FUSION_MAX_DT_US) {
+		f->started = true;
+		goto out;
+	}
+
+	// half angles the gyro turned by in dt, 131 LSB/dps >> full scale
+	fs = READ_ONCE(mpu->gyro_fs);
+	for (i = 0; i < 3; i++)
+		h[i] = ((s64)(s16)get_unaligned_be16(data + GYRO_OFFSET + 2 * i) *
+			dt * GYRO_HALF_ANGLE * (1 << fs)) >> 16;
+
+	for (i = 0; i < 3; i++) {
+		a[i] = (s16)get_unaligned_be16(data + 2 * i);
+		mag2 += a[i] * a[i];
+	}
+
+	if (mag2) {
+		norm = int_sqrt(mag2);
+		for (i = 0; i < 3; i++)
+			a[i] = div_s64((s64)a[i] * Q30, norm);
+
+		// gravity as seen from the estimated orientation
+		v[0] = clamp_t(s64, 2LL * (q30_mul(q[1], q[3]) -
+					   q30_mul(q[0], q[2])), -Q30, Q30);
+		v[1] = clamp_t(s64, 2LL * (q30_mul(q[0], q[1]) +
+					   q30_mul(q[2], q[3])), -Q30, Q30);
+		v[2] = q30_mul(q[0], q[0]) - q30_mul(q[1], q[1]) -
+			q30_mul(q[2], q[2]) + q30_mul(q[3], q[3]);
+
+		// error is the cross product of measured and estimated
+		e[0] = q30_mul(a[1], v[2]) - q30_mul(a[2], v[1]);
+		e[1] = q30_mul(a[2], v[0]) - q30_mul(a[0], v[2]);
+		e[2] = q30_mul(a[0], v[1]) - q30_mul(a[1], v[0]);
+
+		for (i = 0; i < 3; i++) {
+			if (ki)
+				f->integral[i] = clamp_t(s64, f->integral[i] +
+					div_s64((s64)e[i] * ki * dt,
+						1000000000),
+					-FUSION_MAX_INTEGRAL,
+					FUSION_MAX_INTEGRAL);
+			h[i] += div_s64((s64)e[i] * kp * dt, 2000000000) +
+				div_s64((s64)f->integral[i] * dt, 2000000);
+		}
+	}
+
+	// q += q * (0, h)
+	dq[0] = -q30_mul(q[1], h[0]) - q30_mul(q[2], h[1]) - q30_mul(q[3], h[2]);
+	dq[1] = q30_mul(q[0], h[0]) + q30_mul(q[2], h[2]) - q30_mul(q[3], h[1]);
+	dq[2] = q30_mul(q[0], h[1]) - q30_mul(q[1], h[2]) + q30_mul(q[3], h[0]);
+	dq[3] = q30_mul(q[0], h[2]) + q30_mul(q[1], h[1]) - q30_mul(q[2], h[0]);
+
+	n2 = 0;
+	for (i = 0; i < 4; i++) {
+		q[i] += dq[i];
+		n2 += ((s64)q[i] * q[i]) >> 30;
+	}
+
+	// q stays close to unit length, one Newton step renormalizes it
+	scale = (3LL * Q30 - n2) / 2;
+	for (i = 0; i < 4; i++)
+		q[i] = ((s64)q[i] * scale) >> 30;
+
+out:
+	memcpy(quat, q, sizeof(f->q));
+}
+
+/*
+ * @brief Drains the fifo in one pass and fans the new samples out to all
+ *        subscribers. Notifications are coalesced to one per watermark
+ *        samples, or one per wakeup_timeout_us if fewer samples arrive.
+ *
+ * @return Number of samples taken from the fifo.
+ */
+static unsigned int mpu_service(struct altera_mpu *mpu, u64 irq_ns)
+{
+	struct mpu_file *file;
+	bool held_back = false;
+	unsigned int count;
+	u32 start, i;
+
+	mutex_lock(&mpu->fifo_lock);
+	if (mpu->dead) {
+		mutex_unlock(&mpu->fifo_lock);
+		return 0;
+	}
+	start = mpu->head;
+	count = mpu_drain_fifo(mpu, irq_ns);
+	if (mpu->head == start) {
+		mutex_unlock(&mpu->fifo_lock);
+		return count;
+	}
+
+	// once per sample for all quaternion readers
+	if (atomic_read(&mpu->fusion_users))
+		for (i = start; i != mpu->head; i++)
+			mpu_fusion_update(mpu,
+					  mpu->records[i & mpu->ring_mask].data,
+					  mpu->quats[i & mpu->ring_mask]);
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(file, &mpu->subscribers, node)
+		held_back |= mpu_file_update(file, start, mpu->head, irq_ns);
+	rcu_read_unlock();
+	mutex_unlock(&mpu->fifo_lock);
+
+	if (held_back && !hrtimer_active(&mpu->wakeup_timer)) {
+		hrtimer_start(&mpu->wakeup_timer,
+			      ns_to_ktime((u64)mpu->wakeup_timeout_us *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+
+	return count;
+}
+
+/*
+ * @brief Decides after an interrupt whether to switch to polling: the
+ *        pass hit the drain budget, or POLL_ENTER_IRQS interrupts in a
+ *        row came faster than poll_rate_hz.
+ */
+static bool mpu_poll_enter(struct altera_mpu *mpu, u64 irq_ns,
+			   unsigned int count)
+{
+	unsigned int rate = READ_ONCE(mpu->poll_rate_hz);
+	u64 interval = irq_ns - mpu->last_irq_ns;
+
+	mpu->last_irq_ns = irq_ns;
+	if (rate == 0)
+		return false;
+
+	if (interval < NSEC_PER_SEC / rate)
+		mpu->fast_irqs++;
+	else
+		mpu->fast_irqs = 0;
+
+	return count >= mpu->drain_budget || mpu->fast_irqs >= POLL_ENTER_IRQS;
+}
+
+/*
+ * @brief Polls the fifo every poll_interval_us, like NAPI. Runs in the
+ *        irq thread with the interrupt line disabled, which is why
+ *        the line is not shared. A pass that hits the drain budget
+ *        polls again at once. Switches back to interrupts once the
+ *        sample rate drops below half of poll_rate_hz.
+ */
+static void mpu_poll_loop(struct altera_mpu *mpu, unsigned int count)
+{
+	unsigned int interval_us, rate;
+	u64 last = ktime_get_ns();
+	u64 now;
+
+	disable_irq_nosync(mpu->irq_num);
+	WRITE_ONCE(mpu->polling, true);
+	mpu->stat_poll_entries++;
+	trace_mpu_poll(mpu->misc.name, true);
+
+	while (!READ_ONCE(mpu->stopping)) {
+		interval_us = READ_ONCE(mpu->poll_interval_us);
+		if (count < mpu->drain_budget)
+			usleep_range(interval_us, interval_us + interval_us / 4);
+		else
+			cond_resched();
+
+		now = ktime_get_ns();
+		count = mpu_service(mpu, now);
+		mpu->stat_polls++;
+
+		rate = READ_ONCE(mpu->poll_rate_hz);
+		if (rate == 0 ||
+		    (u64)count * 2 * NSEC_PER_SEC < (u64)rate * (now - last))
+			break;
+		last = now;
+	}
+
+	mpu->fast_irqs = 0;
+	WRITE_ONCE(mpu->polling, false);
+	trace_mpu_poll(mpu->misc.name, false);
+
+	// free_irq() is shutting the line down, do not start it again
+	if (!READ_ONCE(mpu->stopping))
+		enable_irq(mpu->irq_num);
+}
+
+/*
+ * @brief IRQ thread function. Serves the interrupt, then keeps polling
+ *        while the interrupt rate is high.
+ */
+static irqreturn_t irq_thread(int irq, void *dev_id)
+{
+	struct altera_mpu *mpu = dev_id;
+	u64 irq_ns = atomic64_read(&mpu->irq_ns);
+	unsigned int count;
+
+	count = mpu_service(mpu, irq_ns);
+	if (mpu_poll_enter(mpu, irq_ns, count))
+		mpu_poll_loop(mpu, count);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * @brief Drains the fifo from the reader for up to the busy poll budget
+ *        of the file, instead of waiting for the interrupt.
+ *
+ * @return true if the file got data.
+ */
+static bool mpu_busy_poll(struct mpu_file *file)
+{
+	unsigned int budget = READ_ONCE(file->busy_poll_us);
+	struct altera_mpu *mpu = file->mpu;
+	u64 end;
+
+	if (budget == 0)
+		return false;
+
+	end = ktime_get_ns() + (u64)budget * NSEC_PER_USEC;
+	do {
+		mpu_service(mpu, ktime_get_ns());
+		if (mpu_data_ready(file)) {
+			atomic64_inc(&mpu->stat_busy_polls);
+			return true;
+		}
+		if (need_resched() || signal_pending(current) ||
+		    READ_ONCE(mpu->dead))
+			break;
+		cpu_relax();
+	} while (ktime_get_ns() < end);
+
+	return false;
+}
+
+/*
+ * @brief Returns the largest record read() hands out on a file.
+ */
+static size_t mpu_record_size(struct mpu_file *file)
+{
+	if (READ_ONCE(file->record_type) == MPU_RECORD_QUAT)
+		return sizeof(struct mpu_quat_record);
+	if (READ_ONCE(file->packer.channels))
+		return MPU_PACKED_MAX_RECORD;
+
+	return CHAR_DEVICE_SIZE;
+}
+
+static inline unsigned int mpu_put_varint(u8 *buf, u64 value)
+{
+	unsigned int len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = value | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+
+	return len;
+}
+
+static inline u64 mpu_zigzag(s64 value)
+{
+	return ((u64)value << 1) ^ (u64)(value >> 63);
+}
+
+/*
+ * @brief Encodes a record into buf, at most MPU_PACKED_MAX_RECORD
+ *        bytes, and moves the encoder state on to it.
+ *
+ * @return Length of the encoded record.
+ */
+static unsigned int mpu_pack_record(struct mpu_packer *p,
+				    const struct mpu_ring_record *rec, u8 *buf)
+{
+	bool key = p->countdown == 0;
+	unsigned int len = 0;
+	s64 delta;
+	u32 hw;
+	s16 value;
+	int i;
+
+	if (key)
+		p->countdown = p->interval;
+	p->countdown--;
+
+	buf[len++] = key ? MPU_PACKED_KEYFRAME : MPU_PACKED_DELTA;
+	if (key)
+		len += mpu_put_varint(buf + len, p->channels);
+
+	// periodic times, the delta of delta is close to 0
+	if (p->channels & MPU_PACK_TIMESTAMP) {
+		delta = rec->timestamp - p->last_timestamp;
+		if (key)
+			len += mpu_put_varint(buf + len, rec->timestamp);
+		else
+			len += mpu_put_varint(buf + len, mpu_zigzag(
+					delta - p->timestamp_delta));
+		p->timestamp_delta = key ? 0 : delta;
+		p->last_timestamp = rec->timestamp;
+	}
+
+	if (p->channels & MPU_PACK_HW_TIME) {
+		memcpy(&hw, &rec->data[TIME_OFFSET - 1], sizeof(hw));
+		delta = (s32)(hw - p->last_hw);
+		if (key)
+			len += mpu_put_varint(buf + len, hw);
+		else
+			len += mpu_put_varint(buf + len, mpu_zigzag(
+					delta - p->hw_delta));
+		p->hw_delta = key ? 0 : delta;
+		p->last_hw = hw;
+	}
+
+	for (i = 0; i < NUM_AXES; i++) {
+		if (!(p->channels & BIT(i)))
+			continue;
+
+		value = get_unaligned_be16(rec->data + 2 * i);
+		len += mpu_put_varint(buf + len, mpu_zigzag(key ? value :
+					(s32)value - p->last[i]));
+		p->last[i] = value;
+	}
+
+	return len;
+}
+
+/*
+ * @brief Hands a raw record to userspace, packed if the file packs.
+ *        Called with the file lock held.
+ *
+ * @return Bytes copied, 0 if the record does not fit or -EFAULT.
+ */
+static ssize_t mpu_copy_raw(struct mpu_file *file, struct iov_iter *to,
+			    const struct mpu_ring_record *rec)
+{
+	u8 buf[MPU_PACKED_MAX_RECORD];
+	struct mpu_packer packer;
+	size_t len;
+
+	if (!file->packer.channels) {
+		if (iov_iter_count(to) < CHAR_DEVICE_SIZE)
+			return 0;
+		if (copy_to_iter(rec->data, CHAR_DEVICE_SIZE, to) !=
+		    CHAR_DEVICE_SIZE)
+			return -EFAULT;
+		return CHAR_DEVICE_SIZE;
+	}
+
+	// the encoder moves on only once the record is handed out
+	packer = file->packer;
+	len = mpu_pack_record(&packer, rec, buf);
+	if (iov_iter_count(to) < len)
+		return 0;
+	if (copy_to_iter(buf, len, to) != len)
+		return -EFAULT;
+	file->packer = packer;
+
+	return len;
+}
+
+/*
+ * @brief Copies records from the shared ring, from the position of the
+ *        file on. Called with the file lock held.
+ *
+ * @return Bytes copied or -EFAULT, *drained tells if the file caught up.
+ */
+static ssize_t mpu_read_ring(struct mpu_file *file, struct iov_iter *to,
+			     u64 delivered, unsigned int *skipped,
+			     bool *drained)
+{
+	struct altera_mpu *mpu = file->mpu;
+	struct mpu_ring_record rec;
+	ssize_t copied = 0;
+	ssize_t len;
+	u32 head, cursor;
+	u32 delay;
+
+	head = READ_ONCE(mpu->head);
+	cursor = mpu_file_cursor(file, head, skipped);
+
+	while (iov_iter_count(to) && cursor != head) {
+		// skips records the irq thread overwrote in the meantime
+		if (!mpu_ring_get(mpu, cursor++, &rec, &delay)) {
+			(*skipped)++;
+			continue;
+		}
+
+		// hand data to userspace
+		len = mpu_copy_raw(file, to, &rec);
+		if (len <= 0) {
+			if (copied == 0)
+				copied = len;
+			cursor--;
+			break;
+		}
+		copied += len;
+
+		mpu_latency_add(mpu, MPU_LAT_IRQ_READER,
+				delivered - rec.timestamp);
+		mpu_latency_add(mpu, MPU_LAT_SENSOR_READER,
+				delivered - rec.timestamp + delay);
+	}
+	WRITE_ONCE(file->cursor, cursor);
+	*drained = cursor == head;
+
+	return copied;
+}
+
+/*
+ * @brief Copies records from the decimation queue of the file. Called
+ *        with the file lock held.
+ *
+ * @return Bytes copied or -EFAULT, *drained tells if the file caught up.
+ */
+static ssize_t mpu_read_queue(struct mpu_file *file, struct iov_iter *to,
+			      u64 delivered, bool *drained)
+{
+	bool quat = file->record_type == MPU_RECORD_QUAT;
+	union mpu_output out;
+	ssize_t copied = 0;
+	ssize_t len;
+
+	while (iov_iter_count(to) && kfifo_peek(&file->decim.queue, &out)) {
+		if (!quat) {
+			len = mpu_copy_raw(file, to, &out.raw);
+		} else if (iov_iter_count(to) < sizeof(out.quat)) {
+			len = 0;
+		} else {
+			len = sizeof(out.quat);
+			if (copy_to_iter(&out.quat, len, to) != len)
+				len = -EFAULT;
+		}
+		if (len <= 0) {
+			if (copied == 0)
+				copied = len;
+			break;
+		}
+		kfifo_skip(&file->decim.queue);
+		copied += len;
+
+		mpu_latency_add(file->mpu, MPU_LAT_IRQ_READER, delivered -
+				(quat ? out.quat.timestamp : out.raw.timestamp));
+	}
+	*drained = kfifo_is_empty(&file->decim.queue);
+
+	return copied;
+}
+
+/*
+ * @brief This function gets executed on fread and readv. Hands out as
+ *        many whole records as fit into the user buffers, blocks until
+ *        the file gets notified unless O_NONBLOCK is set.
+ */
+static ssize_t mpu_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filep = iocb->ki_filp;
+	struct mpu_file *file = filep->private_data;
+	struct altera_mpu *mpu = file->mpu;
+	unsigned int skipped = 0;
+	ssize_t copied;
+	u64 start, delivered;
+	bool drained;
+	int seq;
+
+	if (iov_iter_count(to) < mpu_record_size(file))
+		return -EINVAL;
+
+	start = ktime_get_ns();
+	if (mutex_lock_interruptible(&file->lock))
+		return -ERESTARTSYS;
+
+	while (!mpu_data_ready(file)) {
+		mutex_unlock(&file->lock);
+
+		if (READ_ONCE(mpu->dead))
+			return -ENODEV;
+		if (filep->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		// spin for the busy poll budget before going to sleep
+		if (!mpu_busy_poll(file) &&
+		    wait_event_interruptible(file->wait, mpu_data_ready(file) ||
+					     READ_ONCE(mpu->dead)))
+			return -ERESTARTSYS;
+
+		if (mutex_lock_interruptible(&file->lock))
+			return -ERESTARTSYS;
+	}
+	if (READ_ONCE(mpu->dead)) {
+		mutex_unlock(&file->lock);
+		return -ENODEV;
+	}
+
+	seq = atomic_read(&file->notify_seq);
+	delivered = ktime_get_ns();
+	if (file->decim.factor)
+		copied = mpu_read_queue(file, to, delivered, &drained);
+	else
+		copied = mpu_read_ring(file, to, delivered, &skipped, &drained);
+
+	// wait for the next notification once everything is read
+	if (drained)
+		WRITE_ONCE(file->read_seq, seq);
+
+	mutex_unlock(&file->lock);
+
+	if (copied > 0)
+		atomic64_add(copied, &mpu->stat_bytes_read);
+	if (skipped)
+		atomic64_add(skipped, &mpu->stat_skipped);
+	trace_mpu_read(mpu->misc.name, skipped, copied,
+		       ktime_get_ns() - start);
+
+	return copied;
+}
+
+/*
+ * @brief This function gets executed on poll/select.
+ */
+static unsigned int mpu_poll(struct file *filep, poll_table *wait)
+{
+	struct mpu_file *file = filep->private_data;
+
+	poll_wait(filep, &file->wait, wait);
+
+	if (READ_ONCE(file->mpu->dead))
+		return POLLERR | POLLHUP;
+	if (mpu_data_ready(file))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/*
+ * @brief Reads the config register window, served from the regmap
+ *        cache.
+ */
+static void mpu_read_config(struct altera_mpu *mpu, u8 *values)
+{
+	mutex_lock(&mpu->config_lock);
+	if (mpu->dead)
+		memset(values, 0, MPU_CONFIG_REGS);
+	else
+		regmap_bulk_read(mpu->map, CONFIG_OFFSET, values,
+				 MPU_CONFIG_REGS);
+	mutex_unlock(&mpu->config_lock);
+}
+
+/*
+ * @brief Writes the config register window, regmap skips registers
+ *        that already hold the requested value.
+ *
+ * @return Time spent in the regmap in ns.
+ */
+static u64 mpu_write_config(struct altera_mpu *mpu, const u8 *values)
+{
+	u64 mmio;
+	int i;
+
+	mutex_lock(&mpu->config_lock);
+	mmio = ktime_get_ns();
+	for (i = 0; i < MPU_CONFIG_REGS && !mpu->dead; i++)
+		regmap_update_bits(mpu->map, CONFIG_OFFSET + i, 0xff,
+				   values[i]);
+	mmio = ktime_get_ns() - mmio;
+	WRITE_ONCE(mpu->gyro_fs, (values[CFG_GYRO_CONFIG] >> 3) & 3);
+	mutex_unlock(&mpu->config_lock);
+
+	atomic64_add(mmio, &mpu->stat_mmio_ns);
+
+	return mmio;
+}
+
+/*
+ * @brief Selects the fifo samples are taken from.
+ */
+static void mpu_set_event_mode(struct altera_mpu *mpu, bool event)
+{
+	mutex_lock(&mpu->fifo_lock);
+	if (mpu->event != event) {
+		mpu->event = event;
+		mpu->last_time = 0; // timestamps of the other fifo differ
+	}
+	mutex_unlock(&mpu->fifo_lock);
+}
+
+/*
+ * @brief Replaces the eventfd a subscriber signals, NULL unregisters
+ *        it. Takes over the reference to ctx.
+ */
+static void mpu_set_eventfd(struct mpu_file *file, struct eventfd_ctx *ctx)
+{
+	struct eventfd_ctx *old;
+
+	mutex_lock(&file->lock);
+	old = rcu_dereference_protected(file->eventfd,
+					lockdep_is_held(&file->lock));
+	rcu_assign_pointer(file->eventfd, ctx);
+	mutex_unlock(&file->lock);
+
+	if (old != NULL) {
+		// the irq thread or the timer may still signal it
+		synchronize_rcu();
+		eventfd_ctx_put(old);
+	}
+}
+
+static void mpu_put_signal(struct mpu_signal *sig)
+{
+	if (sig == NULL)
+		return;
+
+	put_pid(sig->pid);
+	put_cred(sig->cred);
+	kfree(sig);
+}
+
+/*
+ * @brief Replaces the signal target of a subscriber, NULL unregisters
+ *        it. Takes over sig.
+ */
+static void mpu_set_signal(struct mpu_file *file, struct mpu_signal *sig)
+{
+	struct mpu_signal *old;
+
+	mutex_lock(&file->lock);
+	old = rcu_dereference_protected(file->signal,
+					lockdep_is_held(&file->lock));
+	rcu_assign_pointer(file->signal, sig);
+	mutex_unlock(&file->lock);
+
+	if (old != NULL) {
+		// the irq thread or the timer may still signal it
+		synchronize_rcu();
+		mpu_put_signal(old);
+	}
+}
+
+/*
+ * @brief Looks up the eventfd of fd, fd < 0 selects none.
+ */
+static struct eventfd_ctx *mpu_get_eventfd(int fd)
+{
+	if (fd < 0)
+		return NULL;
+
+	return eventfd_ctx_fdget(fd);
+}
+
+/*
+ * @brief Only SIGIO and the real time signals can be sent, nothing
+ *        that stops or kills the receiver.
+ */
+static bool mpu_valid_signo(int signo)
+{
+	return signo == SIGIO || (signo >= SIGRTMIN && signo <= SIGRTMAX);
+}
+
+/*
+ * @brief Sets up signo to the process of nr on behalf of the current
+ *        task, nr 0 selects none.
+ */
+static struct mpu_signal *mpu_get_signal(pid_t nr, int signo)
+{
+	struct mpu_signal *sig;
+
+	if (nr == 0)
+		return NULL;
+
+	sig = kzalloc(sizeof(*sig), GFP_KERNEL);
+	if (sig == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	sig->pid = find_get_pid(nr);
+	if (sig->pid == NULL) {
+		kfree(sig);
+		return ERR_PTR(-ESRCH);
+	}
+	sig->cred = get_current_cred();
+	security_task_getsecid(current, &sig->secid);
+	sig->signo = signo;
+
+	return sig;
+}
+
+/*
+ * @brief Replaces notification targets and filter of a subscriber.
+ */
+static int mpu_subscribe(struct mpu_file *file,
+			 const struct mpu_subscription *sub)
+{
+	struct altera_mpu *mpu = file->mpu;
+	int signo = sub->signo ? sub->signo : SIG_TEST;
+	struct eventfd_ctx *ctx;
+	struct mpu_signal *sig;
+
+	if (sub->version != MPU_IOC_VERSION || !mpu_valid_signo(signo) ||
+	    sub->watermark > mpu->ring_mask + 1)
+		return -EINVAL;
+
+	ctx = mpu_get_eventfd(sub->eventfd);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	sig = mpu_get_signal(sub->pid, signo);
+	if (IS_ERR(sig)) {
+		if (ctx != NULL)
+			eventfd_ctx_put(ctx);
+		return PTR_ERR(sig);
+	}
+
+	WRITE_ONCE(file->watermark, sub->watermark);
+	WRITE_ONCE(file->motion_threshold, sub->motion_threshold);
+	mpu_set_eventfd(file, ctx);
+	mpu_set_signal(file, sig);
+
+	return 0;
+}
+
+/*
+ * @brief Restarts the decimator of a file with new settings, factor 0
+ *        reads from the shared ring. Called with the file lock and
+ *        fifo_lock held, the irq thread runs the decimator under the
+ *        latter.
+ */
+static void mpu_decimator_setup(struct mpu_file *file, unsigned int factor,
+				unsigned int filter, unsigned int shift)
+{
+	struct mpu_decimator *d = &file->decim;
+
+	d->filter = filter;
+	d->shift = shift;
+	d->phase = 0;
+	d->primed = false;
+	memset(d->acc, 0, sizeof(d->acc));
+	if (kfifo_initialized(&d->queue))
+		kfifo_reset(&d->queue);
+	WRITE_ONCE(d->factor, factor);
+	file->cursor = file->mpu->head;
+	atomic_set(&file->pending, 0);
+}
+
+/*
+ * @brief Drops all buffered samples, in the hardware fifo and the ring,
+ *        for every open file and the mmap consumer.
+ */
+static void mpu_flush(struct altera_mpu *mpu)
+{
+	struct mpu_decimator *d;
+	struct mpu_file *file;
+	unsigned int budget;
+
+	// keeps the files around while their locks are taken
+	mutex_lock(&mpu->subscribers_lock);
+	mutex_lock(&mpu->fifo_lock);
+
+	// drain the hardware fifo into the ring, then drop the ring
+	budget = mpu->drain_budget;
+	mpu->drain_budget = mpu->ring_mask + 1;
+	if (!mpu->dead)
+		mpu_drain_fifo(mpu, ktime_get_ns());
+	mpu->drain_budget = budget;
+
+	WRITE_ONCE(mpu->flush_head, mpu->head);
+	smp_store_release(&mpu->hdr->tail, mpu->head);
+	mutex_unlock(&mpu->fifo_lock);
+
+	// decimation, filter and quaternion queues start over as well
+	list_for_each_entry(file, &mpu->subscribers, node) {
+		d = &file->decim;
+		mutex_lock(&file->lock);
+		mutex_lock(&mpu->fifo_lock);
+		mpu_decimator_setup(file, d->factor, d->filter, d->shift);
+		mutex_unlock(&mpu->fifo_lock);
+		mutex_unlock(&file->lock);
+	}
+	mutex_unlock(&mpu->subscribers_lock);
+}
+
+/*
+ * @brief Configures decimation and filter of a file. The file starts
+ *        over with the next sample, from the queue or the shared ring.
+ */
+static int mpu_set_decimation(struct mpu_file *file,
+			      const struct mpu_decimation *dec)
+{
+	struct mpu_decimator *d = &file->decim;
+	struct altera_mpu *mpu = file->mpu;
+	bool enable;
+	int retval;
+
+	if (dec->version != MPU_IOC_VERSION || dec->factor == 0 ||
+	    dec->factor > DECIMATION_MAX || dec->filter > MPU_FILTER_IIR ||
+	    (dec->filter == MPU_FILTER_IIR &&
+	     (dec->iir_shift == 0 || dec->iir_shift > IIR_MAX_SHIFT)))
+		return -EINVAL;
+
+	mutex_lock(&file->lock);
+	if (file->record_type == MPU_RECORD_QUAT &&
+	    dec->filter != MPU_FILTER_NONE) {
+		mutex_unlock(&file->lock);
+		return -EINVAL;
+	}
+
+	// quaternions and filtered files are always read from the queue
+	enable = dec->factor > 1 || dec->filter != MPU_FILTER_NONE ||
+		file->record_type == MPU_RECORD_QUAT || file->prog;
+	if (enable && !kfifo_initialized(&d->queue)) {
+		retval = kfifo_alloc(&d->queue, DECIMATION_QUEUE, GFP_KERNEL);
+		if (retval) {
+			mutex_unlock(&file->lock);
+			return retval;
+		}
+	}
+
+	mutex_lock(&mpu->fifo_lock);
+	mpu_decimator_setup(file, enable ? dec->factor : 0, dec->filter,
+			    dec->iir_shift);
+	mutex_unlock(&mpu->fifo_lock);
+
+	mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+/*
+ * @brief Selects raw samples or quaternions for a file. The first
+ *        quaternion reader starts the fusion from the identity.
+ */
+static int mpu_set_record_type(struct mpu_file *file, u32 type)
+{
+	struct mpu_decimator *d = &file->decim;
+	struct altera_mpu *mpu = file->mpu;
+	int retval;
+
+	if (type != MPU_RECORD_RAW && type != MPU_RECORD_QUAT)
+		return -EINVAL;
+
+	mutex_lock(&file->lock);
+	if (type == MPU_RECORD_QUAT && !kfifo_initialized(&d->queue)) {
+		retval = kfifo_alloc(&d->queue, DECIMATION_QUEUE, GFP_KERNEL);
+		if (retval) {
+			mutex_unlock(&file->lock);
+			return retval;
+		}
+	}
+
+	mutex_lock(&mpu->fifo_lock);
+	if (type != file->record_type) {
+		if (type == MPU_RECORD_RAW)
+			atomic_dec(&mpu->fusion_users);
+		else if (atomic_inc_return(&mpu->fusion_users) == 1)
+			mpu_fusion_reset(&mpu->fusion);
+		WRITE_ONCE(file->record_type, type);
+	}
+	if (type == MPU_RECORD_QUAT)
+		WRITE_ONCE(file->packer.channels, 0);
+	mpu_decimator_setup(file, type == MPU_RECORD_QUAT || file->prog ?
+			    1 : 0, MPU_FILTER_NONE, 0);
+	mutex_unlock(&mpu->fifo_lock);
+
+	mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+/*
+ * @brief Configures the packed output of a file, the next record
+ *        handed out is a keyframe.
+ */
+static int mpu_set_packing(struct mpu_file *file,
+			   const struct mpu_packing *packing)
+{
+	if (packing->version != MPU_IOC_VERSION ||
+	    packing->channels & ~MPU_PACK_ALL ||
+	    packing->keyframe_interval > PACKED_MAX_INTERVAL)
+		return -EINVAL;
+
+	mutex_lock(&file->lock);
+	if (file->record_type != MPU_RECORD_RAW) {
+		mutex_unlock(&file->lock);
+		return -EINVAL;
+	}
+
+	memset(&file->packer, 0, sizeof(file->packer));
+	file->packer.interval = packing->keyframe_interval ?:
+		PACKED_KEYFRAME_INTERVAL;
+	WRITE_ONCE(file->packer.channels, packing->channels);
+	mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+/*
+ * @brief Attaches the socket filter program of fd to a file, or
+ *        detaches it for fd -1. A file that gets a filter moves over to
+ *        the queue with the next sample, detaching keeps it there.
+ */
+static int mpu_set_filter(struct mpu_file *file, int fd)
+{
+	struct altera_mpu *mpu = file->mpu;
+	struct bpf_prog *prog = NULL;
+	struct sk_buff *skb = NULL;
+	struct bpf_prog *old_prog;
+	struct sk_buff *old_skb;
+	int retval;
+
+	if (fd >= 0) {
+		prog = bpf_prog_get_type(fd, BPF_PROG_TYPE_SOCKET_FILTER);
+		if (IS_ERR(prog))
+			return PTR_ERR(prog);
+
+		// the program reads the sample as linear packet data
+		skb = alloc_skb(CHAR_DEVICE_SIZE, GFP_KERNEL);
+		if (skb == NULL) {
+			retval = -ENOMEM;
+			goto err_put;
+		}
+		skb_put(skb, CHAR_DEVICE_SIZE);
+	}
+
+	mutex_lock(&file->lock);
+	if (prog && !kfifo_initialized(&file->decim.queue)) {
+		retval = kfifo_alloc(&file->decim.queue, DECIMATION_QUEUE,
+				     GFP_KERNEL);
+		if (retval) {
+			mutex_unlock(&file->lock);
+			goto err_free_skb;
+		}
+	}
+
+	// the irq thread runs the filter under fifo_lock
+	mutex_lock(&mpu->fifo_lock);
+	old_prog = file->prog;
+	old_skb = file->skb;
+	file->prog = prog;
+	file->skb = skb;
+	if (prog && !file->decim.factor)
+		mpu_decimator_setup(file, 1, MPU_FILTER_NONE, 0);
+	mutex_unlock(&mpu->fifo_lock);
+
+	mutex_unlock(&file->lock);
+
+	if (old_prog) {
+		bpf_prog_put(old_prog);
+		kfree_skb(old_skb);
+	}
+
+	return 0;
+
+err_free_skb:
+	kfree_skb(skb);
+err_put:
+	bpf_prog_put(prog);
+	return retval;
+}
+
+/*
+ * @brief Configures busy polling of a file and its PM QoS request.
+ */
+static int mpu_set_busy_poll(struct mpu_file *file,
+			     const struct mpu_busy_poll *bp)
+{
+	if (bp->version != MPU_IOC_VERSION ||
+	    bp->budget_us > BUSY_POLL_MAX_US || bp->cpu_latency_us < -1)
+		return -EINVAL;
+
+	mutex_lock(&file->lock);
+	WRITE_ONCE(file->busy_poll_us, bp->budget_us);
+	if (bp->budget_us && bp->cpu_latency_us >= 0) {
+		if (pm_qos_request_active(&file->qos))
+			pm_qos_update_request(&file->qos, bp->cpu_latency_us);
+		else
+			pm_qos_add_request(&file->qos, PM_QOS_CPU_DMA_LATENCY,
+					   bp->cpu_latency_us);
+	} else if (pm_qos_request_active(&file->qos)) {
+		pm_qos_remove_request(&file->qos);
+	}
+	mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+/*
+ * @brief This function gets executed on fwrite. Every write carries the
+ *        config string from its start, the file is not seekable.
+ */
+static int mpu_write(struct file *filep, const char *buf,
+			  size_t count, loff_t *offp)
+{
+	int i = 0;
+	int result = 0;
+	int nr = 0;
+	u64 mmio;
+	struct mpu_signal *sig;
+	u8 values_to_write[MPU_CONFIG_REGS];
+	char tmp[CONFIG_SIZE+1] = { 0 };
+	struct mpu_file *file = filep->private_data;
+	struct altera_mpu *mpu = file->mpu;
+
+	if (READ_ONCE(mpu->dead))
+		return -ENODEV;
+
+	if (count > CONFIG_SIZE)
+		count = CONFIG_SIZE;
+
+	if (count > 0)
+		count = count - copy_from_user(tmp, buf, count);
+
+	// zero bytes keep what the registers hold, ioctls included
+	mpu_read_config(mpu, values_to_write);
+	for (i = 0; i < MPU_CONFIG_REGS; i++)
+		if (tmp[i] != '\0')
+			values_to_write[i] = tmp[i];
+	mmio = mpu_write_config(mpu, values_to_write);
+	tmp[CONFIG_SIZE] = '\0';
+	mpu_set_event_mode(mpu, tmp[EVENT_OFFSET] == '1');
+
+	// for convenience
+	for(i = PID_OFFSET; i < CONFIG_SIZE;i++)
+		if(tmp[i] < '0' || tmp[i] > '9')
+			tmp[i] = '\0';
+	
+	// set PID, signals this open file's notifications
+	result = kstrtoint(&tmp[PID_OFFSET], 10, &nr);
+	if (result == 0) {
+		sig = mpu_get_signal(nr, SIG_TEST);
+		if (!IS_ERR(sig))
+			mpu_set_signal(file, sig);
+	}
+	printk("PID set: %d\n", nr);
+	trace_mpu_write(mpu->misc.name, count, mmio);
+
+	return count;
+}
+
+/*
+ * @brief This function gets executed on ioctl.
+ */
+static long mpu_ioctl(struct file *filep, unsigned int cmd,
+		      unsigned long arg)
+{
+	struct mpu_file *file = filep->private_data;
+	struct altera_mpu *mpu = file->mpu;
+	void __user *argp = (void __user *)arg;
+	struct mpu_subscription sub;
+	struct mpu_busy_poll bp;
+	struct mpu_decimation dec;
+	struct mpu_packing packing;
+	struct mpu_config config;
+	struct eventfd_ctx *ctx;
+	struct mpu_signal *sig;
+	u32 value;
+	s32 fd;
+
+	if (READ_ONCE(mpu->dead))
+		return -ENODEV;
+
+	switch (cmd) {
+	case MPU_IOC_SET_EVENTFD:
+		if (get_user(fd, (s32 __user *)argp))
+			return -EFAULT;
+		ctx = mpu_get_eventfd(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+		mpu_set_eventfd(file, ctx);
+		return 0;
+
+	case MPU_IOC_GET_CONFIG:
+		memset(&config, 0, sizeof(config));
+		config.version = MPU_IOC_VERSION;
+		mpu_read_config(mpu, config.regs);
+		config.event_mode = mpu->event;
+		rcu_read_lock();
+		sig = rcu_dereference(file->signal);
+		config.pid = sig != NULL ? pid_vnr(sig->pid) : 0;
+		rcu_read_unlock();
+		if (copy_to_user(argp, &config, sizeof(config)))
+			return -EFAULT;
+		return 0;
+
+	case MPU_IOC_SET_CONFIG:
+		if (copy_from_user(&config, argp, sizeof(config)))
+			return -EFAULT;
+		if (config.version != MPU_IOC_VERSION || config.event_mode > 1)
+			return -EINVAL;
+		sig = mpu_get_signal(config.pid, SIG_TEST);
+		if (IS_ERR(sig))
+			return PTR_ERR(sig);
+		mpu_write_config(mpu, config.regs);
+		mpu_set_event_mode(mpu, config.event_mode);
+		mpu_set_signal(file, sig);
+		return 0;
+
+	case MPU_IOC_SET_SAMPLE_RATE:
+		if (get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		if (value > U8_MAX)
+			return -EINVAL;
+		mutex_lock(&mpu->config_lock);
+		if (!mpu->dead)
+			regmap_update_bits(mpu->map,
+					   CONFIG_OFFSET + MPU_CFG_SMPLRT_DIV,
+					   0xff, value);
+		mutex_unlock(&mpu->config_lock);
+		return 0;
+
+	case MPU_IOC_SET_EVENT_MODE:
+		if (get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		if (value > 1)
+			return -EINVAL;
+		mpu_set_event_mode(mpu, value);
+		return 0;
+
+	case MPU_IOC_FLUSH_FIFO:
+		mpu_flush(mpu);
+		return 0;
+
+	case MPU_IOC_SUBSCRIBE:
+		if (copy_from_user(&sub, argp, sizeof(sub)))
+			return -EFAULT;
+		return mpu_subscribe(file, &sub);
+
+	case MPU_IOC_SET_BUSY_POLL:
+		if (copy_from_user(&bp, argp, sizeof(bp)))
+			return -EFAULT;
+		return mpu_set_busy_poll(file, &bp);
+
+	case MPU_IOC_SET_DECIMATION:
+		if (copy_from_user(&dec, argp, sizeof(dec)))
+			return -EFAULT;
+		return mpu_set_decimation(file, &dec);
+
+	case MPU_IOC_SET_RECORD_TYPE:
+		if (get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		return mpu_set_record_type(file, value);
+
+	case MPU_IOC_SET_PACKING:
+		if (copy_from_user(&packing, argp, sizeof(packing)))
+			return -EFAULT;
+		return mpu_set_packing(file, &packing);
+
+	case MPU_IOC_SET_FILTER:
+		if (get_user(fd, (s32 __user *)argp))
+			return -EFAULT;
+		return mpu_set_filter(file, fd);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static void mpu_vm_open(struct vm_area_struct *vma)
+{
+	struct altera_mpu *mpu = vma->vm_private_data;
+
+	kref_get(&mpu->ref);
+	atomic_inc(&mpu->mapped);
+}
+
+static void mpu_vm_close(struct vm_area_struct *vma)
+{
+	struct altera_mpu *mpu = vma->vm_private_data;
+
+	atomic_dec(&mpu->mapped);
+	kref_put(&mpu->ref, mpu_free);
+}
+
+static const struct vm_operations_struct mpu_vm_ops = {
+	.open = mpu_vm_open,
+	.close = mpu_vm_close,
+};
+
+/*
+ * @brief Maps the sample ring (header page and records) to userspace.
+ *        While mapped, the ring is flow controlled by hdr->tail.
+ */
+static int mpu_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct mpu_file *file = filep->private_data;
+	struct altera_mpu *mpu = file->mpu;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int retval;
+
+	if (READ_ONCE(mpu->dead))
+		return -ENODEV;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (vma->vm_pgoff != 0 || size > mpu->ring_bytes)
+		return -EINVAL;
+
+	retval = remap_vmalloc_range(vma, mpu->ring, 0);
+	if (retval)
+		return retval;
+
+	vma->vm_private_data = mpu;
+	vma->vm_ops = &mpu_vm_ops;
+	mpu_vm_open(vma);
+
+	return 0;
+}
+
+/*
+ * @brief This function gets executed on open.
+ */
+static int mpu_open(struct inode *inode, struct file *filep)
+{
+	struct altera_mpu *mpu;
+	struct mpu_file *file;
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (file == NULL)
+		return -ENOMEM;
+
+	// misc_open() stored the miscdevice in private_data, and runs
+	// under the misc lock so remove cannot drop the device meanwhile
+	mpu = container_of(filep->private_data, struct altera_mpu, misc);
+	kref_get(&mpu->ref);
+	file->mpu = mpu;
+	mutex_init(&file->lock);
+	init_waitqueue_head(&file->wait);
+	atomic_set(&file->pending, 0);
+	atomic_set(&file->notify_seq, 0);
+	file->cursor = READ_ONCE(mpu->head);
+	filep->private_data = file;
+
+	mutex_lock(&mpu->subscribers_lock);
+	list_add_tail_rcu(&file->node, &mpu->subscribers);
+	mutex_unlock(&mpu->subscribers_lock);
+
+	// a record stream, reads and writes ignore the file position
+	return nonseekable_open(inode, filep);
+}
+
+/*
+ * @brief This function gets executed on close.
+ */
+static int mpu_release(struct inode *inode, struct file *filep)
+{
+	struct mpu_file *file = filep->private_data;
+	struct altera_mpu *mpu = file->mpu;
+	struct eventfd_ctx *ctx;
+
+	mutex_lock(&mpu->subscribers_lock);
+	list_del_rcu(&file->node);
+	mutex_unlock(&mpu->subscribers_lock);
+
+	// wait for the irq thread and the timer to let go of it
+	synchronize_rcu();
+
+	ctx = rcu_dereference_protected(file->eventfd, 1);
+	if (ctx != NULL)
+		eventfd_ctx_put(ctx);
+	mpu_put_signal(rcu_dereference_protected(file->signal, 1));
+	if (pm_qos_request_active(&file->qos))
+		pm_qos_remove_request(&file->qos);
+	if (file->record_type == MPU_RECORD_QUAT)
+		atomic_dec(&mpu->fusion_users);
+	if (file->prog) {
+		bpf_prog_put(file->prog);
+		kfree_skb(file->skb);
+	}
+	kfifo_free(&file->decim.queue);
+	kfree(file);
+	kref_put(&mpu->ref, mpu_free);
+
+	return 0;
+}
+
+static const struct file_operations mpu_fops = {
+	.owner = THIS_MODULE,
+	.open = mpu_open,
+	.release = mpu_release,
+	.read_iter = mpu_read_iter,
+	.splice_read = generic_file_splice_read,
+	.write = mpu_write,
+	.poll = mpu_poll,
+	.mmap = mpu_mmap,
+	.unlocked_ioctl = mpu_ioctl,
+};
+
+static inline struct altera_mpu *dev_to_mpu(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct altera_mpu, misc);
+}
+
+static ssize_t wakeup_watermark_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->wakeup_watermark);
+}
+
+static ssize_t wakeup_watermark_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct altera_mpu *mpu = dev_to_mpu(dev);
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+	if (value == 0 || value > mpu->ring_mask + 1)
+		return -EINVAL;
+
+	mpu->wakeup_watermark = value;
+
+	return count;
+}
+static DEVICE_ATTR_RW(wakeup_watermark);
+
+static ssize_t wakeup_timeout_us_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->wakeup_timeout_us);
+}
+
+static ssize_t wakeup_timeout_us_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+
+	dev_to_mpu(dev)->wakeup_timeout_us = value;
+
+	return count;
+}
+static DEVICE_ATTR_RW(wakeup_timeout_us);
+
+static ssize_t drain_budget_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->drain_budget);
+}
+
+static ssize_t drain_budget_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct altera_mpu *mpu = dev_to_mpu(dev);
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+	if (value == 0 || value > mpu->ring_mask + 1)
+		return -EINVAL;
+
+	mpu->drain_budget = value;
+
+	return count;
+}
+static DEVICE_ATTR_RW(drain_budget);
+
+static ssize_t poll_rate_hz_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->poll_rate_hz);
+}
+
+static ssize_t poll_rate_hz_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+
+	WRITE_ONCE(dev_to_mpu(dev)->poll_rate_hz, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(poll_rate_hz);
+
+static ssize_t poll_interval_us_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->poll_interval_us);
+}
+
+static ssize_t poll_interval_us_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+	if (value == 0 || value > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(dev_to_mpu(dev)->poll_interval_us, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(poll_interval_us);
+
+static ssize_t polling_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", READ_ONCE(dev_to_mpu(dev)->polling));
+}
+static DEVICE_ATTR_RO(polling);
+
+static ssize_t fusion_kp_milli_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->fusion_kp_milli);
+}
+
+static ssize_t fusion_kp_milli_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+	if (value > FUSION_MAX_GAIN_MILLI)
+		return -EINVAL;
+
+	WRITE_ONCE(dev_to_mpu(dev)->fusion_kp_milli, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(fusion_kp_milli);
+
+static ssize_t fusion_ki_milli_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_mpu(dev)->fusion_ki_milli);
+}
+
+static ssize_t fusion_ki_milli_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+	if (value > FUSION_MAX_GAIN_MILLI)
+		return -EINVAL;
+
+	WRITE_ONCE(dev_to_mpu(dev)->fusion_ki_milli, value);
+
+	return count;
+}
+static DEVICE_ATTR_RW(fusion_ki_milli);
+
+static ssize_t overflows_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(dev_to_mpu(dev)->hdr->overflows));
+}
+static DEVICE_ATTR_RO(overflows);
+
+static struct attribute *mpu_attrs[] = {
+	&dev_attr_wakeup_watermark.attr,
+	&dev_attr_wakeup_timeout_us.attr,
+	&dev_attr_drain_budget.attr,
+	&dev_attr_poll_rate_hz.attr,
+	&dev_attr_poll_interval_us.attr,
+	&dev_attr_polling.attr,
+	&dev_attr_fusion_kp_milli.attr,
+	&dev_attr_fusion_ki_milli.attr,
+	&dev_attr_overflows.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(mpu);
+
+static int mpu_debugfs_atomic64_get(void *data, u64 *val)
+{
+	*val = atomic64_read(data);
+	return 0;
+}
+
+static int mpu_debugfs_atomic64_set(void *data, u64 val)
+{
+	atomic64_set(data, val);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(mpu_debugfs_atomic64_fops, mpu_debugfs_atomic64_get,
+			mpu_debugfs_atomic64_set, "%llu\n");
+
+/*
+ * @brief Prints the latency histograms, one row per bucket with its
+ *        lower bound in ns.
+ */
+static int mpu_latency_show(struct seq_file *m, void *v)
+{
+	struct altera_mpu *mpu = m->private;
+	struct mpu_latency *lat;
+	u64 count;
+	int bucket, stage, cpu;
+
+	seq_puts(m, "ns");
+	for (stage = 0; stage < MPU_LAT_STAGES; stage++)
+		seq_printf(m, " %s", mpu_lat_names[stage]);
+	seq_puts(m, "\n");
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seq_printf(m, "%llu", bucket ? 1ULL << (bucket + 9) : 0);
+		for (stage = 0; stage < MPU_LAT_STAGES; stage++) {
+			count = 0;
+			for_each_possible_cpu(cpu) {
+				lat = per_cpu_ptr(mpu->latency, cpu);
+				count += lat->count[stage][bucket];
+			}
+			seq_printf(m, " %llu", count);
+		}
+		seq_puts(m, "\n");
+	}
+
+	return 0;
+}
+
+static int mpu_latency_open(struct inode *inode, struct file *filep)
+{
+	return single_open(filep, mpu_latency_show, inode->i_private);
+}
+
+/*
+ * @brief Any write clears the histograms.
+ */
+static ssize_t mpu_latency_write(struct file *filep, const char __user *buf,
+				 size_t count, loff_t *offp)
+{
+	struct seq_file *m = filep->private_data;
+	struct altera_mpu *mpu = m->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(mpu->latency, cpu), 0,
+		       sizeof(struct mpu_latency));
+
+	return count;
+}
+
+static const struct file_operations mpu_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = mpu_latency_open,
+	.read = seq_read,
+	.write = mpu_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * @brief Prints the hardware clock estimate.
+ */
+static int mpu_clock_show(struct seq_file *m, void *v)
+{
+	struct altera_mpu *mpu = m->private;
+	struct mpu_clock clk;
+
+	mutex_lock(&mpu->fifo_lock);
+	clk = mpu->clock;
+	mutex_unlock(&mpu->fifo_lock);
+
+	seq_printf(m, "offset_ns %lld\n", clk.windows ? clk.offset_ns :
+		   clk.win_min);
+	seq_printf(m, "drift_ppb %lld\n", clk.drift_ppb);
+	seq_printf(m, "estimates %u\n", clk.windows);
+
+	return 0;
+}
+
+static int mpu_clock_open(struct inode *inode, struct file *filep)
+{
+	return single_open(filep, mpu_clock_show, inode->i_private);
+}
+
+static const struct file_operations mpu_clock_fops = {
+	.owner = THIS_MODULE,
+	.open = mpu_clock_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * @brief Exports the statistics to /sys/kernel/debug/<device>. Writing
+ *        a value resets a counter. Debugfs is optional, errors are
+ *        ignored.
+ */
+static void mpu_debugfs_init(struct altera_mpu *mpu)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(mpu->misc.name, NULL);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	mpu->debugfs = dir;
+
+	debugfs_create_u64("interrupts", 0600, dir, &mpu->stat_interrupts);
+	debugfs_create_u64("samples", 0600, dir, &mpu->stat_samples);
+	debugfs_create_u64("drops", 0600, dir, &mpu->stat_drops);
+	debugfs_create_u64("max_wakeup_ns", 0600, dir,
+			   &mpu->stat_max_wakeup_ns);
+	debugfs_create_u64("polls", 0600, dir, &mpu->stat_polls);
+	debugfs_create_u64("poll_entries", 0600, dir, &mpu->stat_poll_entries);
+	debugfs_create_file("skipped", 0600, dir, &mpu->stat_skipped,
+			    &mpu_debugfs_atomic64_fops);
+	debugfs_create_file("bytes_read", 0600, dir, &mpu->stat_bytes_read,
+			    &mpu_debugfs_atomic64_fops);
+	debugfs_create_file("mmio_ns", 0600, dir, &mpu->stat_mmio_ns,
+			    &mpu_debugfs_atomic64_fops);
+	debugfs_create_file("busy_polls", 0600, dir, &mpu->stat_busy_polls,
+			    &mpu_debugfs_atomic64_fops);
+	debugfs_create_file("filtered", 0600, dir, &mpu->stat_filtered,
+			    &mpu_debugfs_atomic64_fops);
+	debugfs_create_file("latency", 0600, dir, mpu, &mpu_latency_fops);
+	debugfs_create_file("clock", 0400, dir, mpu, &mpu_clock_fops);
+}
+
+/*
+ * @brief Only the config window is cached, the fifos change under us.
+ */
+static bool mpu_volatile_reg(struct device *dev, unsigned int reg)
+{
+	return reg < CONFIG_OFFSET || reg >= CONFIG_OFFSET + MPU_CONFIG_REGS;
+}
+
+static const struct regmap_config mpu_regmap_config = {
+	.name = DRIVER_NAME,
+	.reg_bits = 32,
+	.val_bits = 8,
+	.reg_stride = 1,
+	.max_register = EVENT_REGS_OFFSET + EVENT_REGS_SIZE - 1,
+	.volatile_reg = mpu_volatile_reg,
+	.cache_type = REGCACHE_RBTREE,
+};
+
+static int mpu_probe(struct platform_device *pdev)
+{
+	u8 config[MPU_CONFIG_REGS];
+	struct altera_mpu *mpu;
+	int retval;
+
+	// not devm, open files and mappings may outlive the binding
+	mpu = kzalloc(sizeof(*mpu), GFP_KERNEL);
+	if (mpu == NULL)
+		return -ENOMEM;
+	kref_init(&mpu->ref);
+	platform_set_drvdata(pdev, mpu);
+
+	mpu->regs = fakefpga_ioremap(pdev, &mpu->size);
+	if (IS_ERR(mpu->regs)) {
+		retval = PTR_ERR(mpu->regs);
+		goto err_put;
+	}
+
+	mpu->map = devm_regmap_init_mmio(&pdev->dev, mpu->regs,
+					 &mpu_regmap_config);
+	if (IS_ERR(mpu->map)) {
+		retval = PTR_ERR(mpu->map);
+		goto err_put;
+	}
+
+	// start from what the hardware is configured to, fills the cache
+	mutex_init(&mpu->config_lock);
+	mpu_read_config(mpu, config);
+	mpu->gyro_fs = (config[CFG_GYRO_CONFIG] >> 3) & 3;
+
+	mpu->latency = alloc_percpu(struct mpu_latency);
+	if (mpu->latency == NULL) {
+		retval = -ENOMEM;
+		goto err_put;
+	}
+
+	retval = mpu_ring_alloc(mpu, ring_size);
+	if (retval)
+		goto err_put;
+
+	// numbered nodes, one per IP instance
+	mpu->id = ida_simple_get(&mpu_ida, 0, 0, GFP_KERNEL);
+	if (mpu->id < 0) {
+		retval = mpu->id;
+		goto err_put;
+	}
+	mpu->misc.name = kasprintf(GFP_KERNEL, "%s%d", DRIVER_NAME, mpu->id);
+	if (mpu->misc.name == NULL) {
+		retval = -ENOMEM;
+		goto err_free_id;
+	}
+
+	seqcount_init(&mpu->seq);
+	atomic_set(&mpu->mapped, 0);
+	mutex_init(&mpu->fifo_lock);
+	hrtimer_init(&mpu->wakeup_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mpu->wakeup_timer.function = mpu_wakeup_timeout;
+	mpu->wakeup_watermark = WAKEUP_WATERMARK;
+	mpu->wakeup_timeout_us = WAKEUP_TIMEOUT_US;
+	mpu->drain_budget = DRAIN_BUDGET;
+	mpu->poll_rate_hz = POLL_RATE_HZ;
+	mpu->poll_interval_us = POLL_INTERVAL_US;
+	atomic_set(&mpu->fusion_users, 0);
+	mpu->fusion_kp_milli = FUSION_KP_MILLI;
+	mpu->fusion_ki_milli = FUSION_KI_MILLI;
+	INIT_LIST_HEAD(&mpu->subscribers);
+	mutex_init(&mpu->subscribers_lock);
+	atomic64_set(&mpu->irq_ns, 0);
+	atomic64_set(&mpu->stat_skipped, 0);
+	atomic64_set(&mpu->stat_bytes_read, 0);
+	atomic64_set(&mpu->stat_mmio_ns, 0);
+	atomic64_set(&mpu->stat_busy_polls, 0);
+	atomic64_set(&mpu->stat_filtered, 0);
+
+	mpu->irq_num = platform_get_irq(pdev, 0);
+	if (mpu->irq_num < 0) {
+		retval = mpu->irq_num;
+		goto err_free_id;
+	}
+
+	// not shared, the poll loop disables the whole line
+	retval = devm_request_threaded_irq(&pdev->dev, mpu->irq_num,
+					   irq_handler, irq_thread,
+					   IRQF_ONESHOT, mpu->misc.name, mpu);
+	if (retval) {
+		dev_err(&pdev->dev, "Request irq failed!\n");
+		goto err_free_id;
+	}
+
+	mpu->misc.minor = MISC_DYNAMIC_MINOR;
+	mpu->misc.fops = &mpu_fops;
+	mpu->misc.parent = &pdev->dev;
+	mpu->misc.groups = mpu_groups;
+	retval = misc_register(&mpu->misc);
+	if (retval) {
+		dev_err(&pdev->dev, "Register misc device failed!\n");
+		goto err_free_irq;
+	}
+	mpu_debugfs_init(mpu);
+
+	dev_info(&pdev->dev, "%s driver loaded!", mpu->misc.name);
+
+	return 0;
+
+err_free_irq:
+	devm_free_irq(&pdev->dev, mpu->irq_num, mpu);
+err_free_id:
+	ida_simple_remove(&mpu_ida, mpu->id);
+err_put:
+	platform_set_drvdata(pdev, NULL);
+	kref_put(&mpu->ref, mpu_free);
+	return retval;
+}
+
+static int mpu_remove(struct platform_device *pdev)
+{
+	struct altera_mpu *mpu = platform_get_drvdata(pdev);
+	struct mpu_file *file;
+
+	debugfs_remove_recursive(mpu->debugfs);
+	misc_deregister(&mpu->misc);
+
+	// stop the producer, the registers go away with the binding
+	WRITE_ONCE(mpu->stopping, true);
+	devm_free_irq(&pdev->dev, mpu->irq_num, mpu);
+	mutex_lock(&mpu->fifo_lock);
+	mutex_lock(&mpu->config_lock);
+	WRITE_ONCE(mpu->dead, true);
+	mutex_unlock(&mpu->config_lock);
+	mutex_unlock(&mpu->fifo_lock);
+	hrtimer_cancel(&mpu->wakeup_timer);
+
+	// files still open see -ENODEV, wake the ones asleep in read()
+	rcu_read_lock();
+	list_for_each_entry_rcu(file, &mpu->subscribers, node)
+		wake_up_interruptible(&file->wait);
+	rcu_read_unlock();
+
+	ida_simple_remove(&mpu_ida, mpu->id);
+	platform_set_drvdata(pdev, NULL);
+
+	// the ring stays until the last open file or mapping is gone
+	kref_put(&mpu->ref, mpu_free);
 
 	return 0;
 }
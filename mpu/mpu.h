@@ -0,0 +1,269 @@
+/*
+ * Terasic DE1-SoC mpu driver - userspace interface
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _MPU_H
+#define _MPU_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// size of one raw record as returned by read()
+#define MPU_RECORD_SIZE 22
+
+/*
+ * Sample ring shared with userspace via mmap() of /dev/mpu.
+ *
+ * The mapping starts with struct mpu_ring_header, the records follow at
+ * data_offset (page aligned). The driver is the only producer and
+ * advances head, the consumer advances tail. Both are free running
+ * counters, the record of index i lives at (i & (size - 1)).
+ *
+ * Consumer loop:
+ *	head = load_acquire(&hdr->head);
+ *	while (tail != head)
+ *		consume(&records[tail++ & (hdr->size - 1)]);
+ *	store_release(&hdr->tail, tail);
+ *
+ * While the ring is mapped and full new samples are dropped and
+ * overflows is incremented. poll() on the file descriptor reports
+ * POLLIN once the wakeup watermark is reached.
+ *
+ * read() does not consume from the ring: every open file reads from
+ * its own position, starting with the first sample after open(). A
+ * reader that falls behind by more than size records skips the oldest.
+ * splice() and sendfile() hand out the same records as read(), copied
+ * from the ring straight into the pipe pages, so loggers can stream to
+ * a file or socket without passing the data through userspace.
+ */
+#define MPU_RING_VERSION 1
+#define MPU_RING_CACHELINE 64
+
+struct mpu_ring_record {
+	// CLOCK_MONOTONIC in ns of the interrupt that announced the
+	// sample, or of the fifo read for samples taken later in a pass
+	__u64 timestamp;
+	__u8 data[MPU_RECORD_SIZE];
+	__u8 reserved[2];
+};
+
+struct mpu_ring_header {
+	// layout, constant for the lifetime of the mapping
+	__u32 version;
+	__u32 size;
+	__u32 record_size;
+	__u32 data_offset;
+	__u8 pad0[MPU_RING_CACHELINE - 4 * sizeof(__u32)];
+
+	// written by the driver
+	__u32 head;
+	__u32 overflows;
+	__u8 pad1[MPU_RING_CACHELINE - 2 * sizeof(__u32)];
+
+	// written by the consumer
+	__u32 tail;
+	__u8 pad2[MPU_RING_CACHELINE - sizeof(__u32)];
+};
+
+/*
+ * ioctl interface
+ *
+ * Every open file is a subscriber with its own notification targets,
+ * set with the ioctls below and dropped on close().
+ *
+ * MPU_IOC_SET_EVENTFD: registers an eventfd that is signalled whenever
+ *	the driver notifies this file. Its counter is incremented by the
+ *	number of new samples, so one read() of the eventfd returns how
+ *	many samples arrived since the last one. Pass -1 to unregister.
+ *
+ * MPU_IOC_GET_CONFIG/MPU_IOC_SET_CONFIG: reads or replaces the whole
+ *	configuration. version must be MPU_IOC_VERSION. Only registers
+ *	whose value differs from the current one are written. pid is the
+ *	receiver of SIG_TEST for this file.
+ *
+ * MPU_IOC_SET_SAMPLE_RATE: writes the sample rate divider register
+ *	(regs[MPU_CFG_SMPLRT_DIV], 0..255).
+ *
+ * MPU_IOC_SET_EVENT_MODE: 1 selects the event fifo, 0 the streaming
+ *	fifo.
+ *
+ * MPU_IOC_FLUSH_FIFO: drops all buffered samples, in the ring as well
+ *	as in the hardware fifo, for all open files. The queued
+ *	decimation, filter and quaternion outputs of every open file are
+ *	dropped as well.
+ *
+ * MPU_IOC_SUBSCRIBE: replaces all notification targets and the filter
+ *	of this file, see struct mpu_subscription.
+ *
+ * MPU_IOC_SET_BUSY_POLL: configures busy polling of blocking reads on
+ *	this file, see struct mpu_busy_poll.
+ *
+ * MPU_IOC_SET_DECIMATION: configures decimation and low pass filter of
+ *	this file, see struct mpu_decimation.
+ *
+ * MPU_IOC_SET_RECORD_TYPE: selects what read() returns on this file,
+ *	MPU_RECORD_RAW samples or MPU_RECORD_QUAT orientations, see
+ *	struct mpu_quat_record. Turns decimation and packing off.
+ *
+ * MPU_IOC_SET_PACKING: selects the packed output format for raw
+ *	records on this file, see struct mpu_packing.
+ *
+ * MPU_IOC_SET_FILTER: attaches the BPF_PROG_TYPE_SOCKET_FILTER program
+ *	of the given fd to this file, -1 detaches it. The program runs on
+ *	every drained sample, seeing the MPU_RECORD_SIZE raw bytes as
+ *	packet data. It returns 0 to drop the sample, or the number of
+ *	bytes to keep, the rest is zeroed. Dropped samples are neither
+ *	queued nor counted towards notifications. A filtered file reads
+ *	from a private queue of 64 records like a decimating one, the
+ *	program runs before the decimation.
+ */
+#define MPU_IOC_MAGIC 'm'
+#define MPU_IOC_VERSION 1
+
+#define MPU_CONFIG_REGS 15
+#define MPU_CFG_SMPLRT_DIV 0
+
+struct mpu_config {
+	__u32 version;
+	__u8 regs[MPU_CONFIG_REGS]; // config register window
+	__u8 event_mode;
+	__s32 pid; // receiver of SIG_TEST, 0 for none
+};
+
+/*
+ * Notification targets and filter of one open file. A notification
+ * wakes up read() and poll(), signals eventfd (-1 for none) and sends
+ * signo (0 selects SIG_TEST) to pid (0 for none). Only SIGIO and the
+ * real time signals are accepted. Signals are sent with the
+ * credentials of the task that set the target, which has to be allowed
+ * to signal pid.
+ *
+ * A notification is sent once watermark samples passed the filter (0
+ * selects the wakeup_watermark sysfs attribute), or wakeup_timeout_us
+ * after the first of fewer samples. With a motion_threshold a sample
+ * passes only if an accel axis (raw big endian s16 at data[0..5])
+ * moved by more than the threshold since the last sample that passed.
+ * The filter only gates notifications, read() returns every sample.
+ */
+struct mpu_subscription {
+	__u32 version;
+	__s32 eventfd;
+	__s32 pid;
+	__u32 signo;
+	__u32 watermark;
+	__u32 motion_threshold;
+};
+
+/*
+ * Busy polling for a single low latency consumer. A blocking read()
+ * with nothing to hand out drains the hardware fifo itself for up to
+ * budget_us (0 disables, at most 10000) before it goes to sleep. The
+ * file is ready once its watermark is reached, use a watermark of 1
+ * to get every sample. cpu_latency_us >= 0 holds a PM QoS CPU latency
+ * request of that value while busy polling is enabled, -1 holds none.
+ */
+struct mpu_busy_poll {
+	__u32 version;
+	__u32 budget_us;
+	__s32 cpu_latency_us;
+};
+
+/*
+ * Decimation of the samples read from this file. Every factor-th
+ * sample (1..1024) is handed out, the nine axes low pass filtered
+ * beforehand:
+ *	MPU_FILTER_NONE	no filter, the axes of the sample itself
+ *	MPU_FILTER_FIR	average of the factor samples since the last output
+ *	MPU_FILTER_IIR	first order IIR y += (x - y) / 2^iir_shift
+ *			(iir_shift 1..12), run on every sample
+ * Quaternion files only take MPU_FILTER_NONE.
+ * The timestamps are those of the newest input sample. A decimating
+ * file reads from a private queue of 64 records, outputs that do not
+ * fit are dropped. Watermark and motion filter count outputs. A factor
+ * of 1 with MPU_FILTER_NONE turns decimation off.
+ */
+#define MPU_FILTER_NONE 0
+#define MPU_FILTER_FIR 1
+#define MPU_FILTER_IIR 2
+
+struct mpu_decimation {
+	__u32 version;
+	__u32 factor;
+	__u32 filter;
+	__u32 iir_shift;
+};
+
+/*
+ * Orientation record of MPU_RECORD_QUAT files. The driver runs a six
+ * axis Mahony filter (accel and gyro, no magnetometer, so the heading
+ * drifts) on every sample while any file reads quaternions, starting
+ * from the identity. Decimation with MPU_FILTER_NONE lowers the rate.
+ */
+#define MPU_RECORD_RAW 0
+#define MPU_RECORD_QUAT 1
+
+struct mpu_quat_record {
+	__u64 timestamp; // as in struct mpu_ring_record
+	__s32 q[4]; // w, x, y, z in Q30 fixed point
+	__u32 hw_time; // hardware timestamp of the sample
+	__u32 reserved;
+};
+
+/*
+ * Packed output of raw records, for long captures. read() hands out a
+ * byte stream of whole records of at most MPU_PACKED_MAX_RECORD bytes,
+ * a buffer that size is needed for read() to make progress. Each
+ * record is a type byte followed by the selected channels in channel
+ * bit order, as LEB128 varints:
+ *	MPU_PACKED_KEYFRAME	the channel mask, the timestamp and the
+ *				hardware time as they are, the axes
+ *				zigzag encoded
+ *	MPU_PACKED_DELTA	zigzag encoded differences to the previous
+ *				record: of the axes, and of the time
+ *				deltas (delta of delta) for both times
+ * The first record and every keyframe_interval-th record (0 selects
+ * 256, at most 65535) are keyframes, a decoder can start at any of
+ * them. Records lost to lapping do not break decoding, the deltas are
+ * taken to the previous record handed out. Channels 0 turns packing
+ * off. Only raw files pack, the shared ring stays unpacked.
+ */
+#define MPU_PACK_AXES 0x1ff // bit n: big endian s16 axis at data[2n]
+#define MPU_PACK_HW_TIME (1 << 9)
+#define MPU_PACK_TIMESTAMP (1 << 10)
+#define MPU_PACK_ALL (MPU_PACK_AXES | MPU_PACK_HW_TIME | MPU_PACK_TIMESTAMP)
+
+#define MPU_PACKED_DELTA 0
+#define MPU_PACKED_KEYFRAME 1
+#define MPU_PACKED_MAX_RECORD 45
+
+struct mpu_packing {
+	__u32 version;
+	__u32 channels; // MPU_PACK_* mask
+	__u32 keyframe_interval;
+};
+
+#define MPU_IOC_SET_EVENTFD _IOW(MPU_IOC_MAGIC, 1, __s32)
+#define MPU_IOC_GET_CONFIG _IOR(MPU_IOC_MAGIC, 2, struct mpu_config)
+#define MPU_IOC_SET_CONFIG _IOW(MPU_IOC_MAGIC, 3, struct mpu_config)
+#define MPU_IOC_SET_SAMPLE_RATE _IOW(MPU_IOC_MAGIC, 4, __u32)
+#define MPU_IOC_SET_EVENT_MODE _IOW(MPU_IOC_MAGIC, 5, __u32)
+#define MPU_IOC_FLUSH_FIFO _IO(MPU_IOC_MAGIC, 6)
+#define MPU_IOC_SUBSCRIBE _IOW(MPU_IOC_MAGIC, 7, struct mpu_subscription)
+#define MPU_IOC_SET_BUSY_POLL _IOW(MPU_IOC_MAGIC, 8, struct mpu_busy_poll)
+#define MPU_IOC_SET_DECIMATION _IOW(MPU_IOC_MAGIC, 9, struct mpu_decimation)
+#define MPU_IOC_SET_RECORD_TYPE _IOW(MPU_IOC_MAGIC, 10, __u32)
+#define MPU_IOC_SET_PACKING _IOW(MPU_IOC_MAGIC, 11, struct mpu_packing)
+#define MPU_IOC_SET_FILTER _IOW(MPU_IOC_MAGIC, 12, __s32)
+
+#endif /* _MPU_H */
@@ -0,0 +1,157 @@
+/*
+ * Terasic DE1-SoC mpu driver - tracepoints
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mpu
+
+#if !defined(_MPU_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MPU_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Hard irq entry, the start of every irq to wakeup latency.
+ */
+TRACE_EVENT(mpu_irq,
+	TP_PROTO(const char *name, int irq),
+	TP_ARGS(name, irq),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(int, irq)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->irq = irq;
+	),
+	TP_printk("%s irq=%d", __get_str(name), __entry->irq)
+);
+
+/*
+ * One fifo drain pass of the irq thread. mmio_ns is the part of
+ * duration_ns spent reading registers.
+ */
+TRACE_EVENT(mpu_drain,
+	TP_PROTO(const char *name, unsigned int samples, unsigned int dropped,
+		 u64 mmio_ns, u64 duration_ns),
+	TP_ARGS(name, samples, dropped, mmio_ns, duration_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, samples)
+		__field(unsigned int, dropped)
+		__field(u64, mmio_ns)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->samples = samples;
+		__entry->dropped = dropped;
+		__entry->mmio_ns = mmio_ns;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("%s samples=%u dropped=%u mmio_ns=%llu duration_ns=%llu",
+		  __get_str(name), __entry->samples, __entry->dropped, __entry->mmio_ns,
+		  __entry->duration_ns)
+);
+
+/*
+ * The irq thread switched to polling or back to interrupts.
+ */
+TRACE_EVENT(mpu_poll,
+	TP_PROTO(const char *name, bool polling),
+	TP_ARGS(name, polling),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(bool, polling)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->polling = polling;
+	),
+	TP_printk("%s %s", __get_str(name),
+		  __entry->polling ? "poll" : "irq")
+);
+
+/*
+ * A subscriber got woken up, latency_ns counts from the last hard irq.
+ */
+TRACE_EVENT(mpu_notify,
+	TP_PROTO(const char *name, unsigned int count, u64 latency_ns),
+	TP_ARGS(name, count, latency_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, count)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->count = count;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("%s count=%u latency_ns=%llu",
+		  __get_str(name), __entry->count, __entry->latency_ns)
+);
+
+/*
+ * One read() of a subscriber, skipped counts records it was lapped by.
+ * duration_ns includes the wait for the notification.
+ */
+TRACE_EVENT(mpu_read,
+	TP_PROTO(const char *name, unsigned int skipped, ssize_t ret,
+		 u64 duration_ns),
+	TP_ARGS(name, skipped, ret, duration_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, skipped)
+		__field(ssize_t, ret)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->skipped = skipped;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("%s skipped=%u ret=%zd duration_ns=%llu",
+		  __get_str(name), __entry->skipped, __entry->ret,
+		  __entry->duration_ns)
+);
+
+/*
+ * One write() of the config string, mmio_ns spent in the regmap.
+ */
+TRACE_EVENT(mpu_write,
+	TP_PROTO(const char *name, size_t count, u64 mmio_ns),
+	TP_ARGS(name, count, mmio_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(size_t, count)
+		__field(u64, mmio_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->count = count;
+		__entry->mmio_ns = mmio_ns;
+	),
+	TP_printk("%s count=%zu mmio_ns=%llu", __get_str(name),
+		  __entry->count, __entry->mmio_ns)
+);
+
+#endif /* _MPU_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mpu_trace
+#include <trace/define_trace.h>
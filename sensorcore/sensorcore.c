@@ -0,0 +1,1339 @@
+/*
+ * Terasic DE1-SoC register mapped sensor core
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/io.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <asm/unaligned.h>
+
+#include "sensorcore.h"
+#include "fakefpga.h"
+
+#define CREATE_TRACE_POINTS
+#include "sensorcore_trace.h"
+
+// Sampler defaults
+#define HISTORY_SIZE 256 // samples, rounded up to a power of two
+#define MIN_PERIOD_US 1000 // keeps the timer from hogging the CPU
+
+// rolling statistics windows, shortest first
+static const unsigned int stats_windows_ms[SSL_SENSOR_STATS_WINDOWS] = {
+	1000, 60000, 600000,
+};
+
+// comparator zones
+enum {
+	ZONE_INSIDE,
+	ZONE_ABOVE,
+	ZONE_BELOW,
+};
+
+static unsigned int history_size = HISTORY_SIZE;
+module_param(history_size, uint, S_IRUGO);
+MODULE_PARM_DESC(history_size, "Number of samples kept per device");
+
+// u64 aligned stack buffers for one sample or event of any sensor
+#define SAMPLE_BUF_WORDS DIV_ROUND_UP(sizeof(struct ssl_sensor_sample) + \
+				      SSL_SENSOR_MAX_RECORD, sizeof(u64))
+#define EVENT_BUF_WORDS DIV_ROUND_UP(sizeof(struct ssl_sensor_event) + \
+				     SSL_SENSOR_MAX_RECORD, sizeof(u64))
+
+// per open file state
+struct ssl_sensor_file {
+	struct ssl_sensor *sensor;
+	struct mutex lock; // serializes stream reads
+	u32 mode;
+	u32 event_seq; // newest event this file has seen
+	u32 cursor; // next sample in SSL_SENSOR_MODE_STREAM
+};
+
+static inline struct ssl_sensor_sample *
+ssl_sensor_slot(struct ssl_sensor *sensor, u32 index)
+{
+	return sensor->samples + (index & sensor->mask) * sensor->stride;
+}
+
+/*
+ * @brief Extracts the value of a channel from a record.
+ */
+static u32 ssl_sensor_channel_value(const struct ssl_sensor_channel *ch,
+				    const u8 *record)
+{
+	switch (ch->width) {
+	case 1:
+		return record[ch->offset];
+	case 2:
+		return get_unaligned_le16(record + ch->offset);
+	default:
+		return get_unaligned_le32(record + ch->offset);
+	}
+}
+
+/*
+ * @brief Returns the zone of value, hysteresis widens the limit the
+ *        value has to cross to leave its current zone.
+ */
+static u8 ssl_sensor_zone(const struct ssl_sensor_comparator *cmp, u32 value)
+{
+	u32 high = cmp->high;
+	u32 low = cmp->low;
+
+	if (cmp->zone == ZONE_ABOVE)
+		high = high > cmp->hysteresis ? high - cmp->hysteresis : 0;
+	else if (cmp->zone == ZONE_BELOW)
+		low = low < U32_MAX - cmp->hysteresis ?
+			low + cmp->hysteresis : U32_MAX;
+
+	if (value > high)
+		return ZONE_ABOVE;
+	if (value < low)
+		return ZONE_BELOW;
+	return ZONE_INSIDE;
+}
+
+/*
+ * @brief Runs the comparators on a sample, records an event and wakes
+ *        up event readers if a channel changed zone. Called inside the
+ *        write section of the sensor seqcount.
+ *
+ * @return true if readers need to be woken up.
+ */
+static bool ssl_sensor_compare(struct ssl_sensor *sensor,
+			       const struct ssl_sensor_sample *sample)
+{
+	struct ssl_sensor_comparator *cmp;
+	u32 crossed = 0;
+	u32 above = 0;
+	u32 below = 0;
+	u8 zone;
+	int i;
+
+	for (i = 0; i < sensor->num_channels; i++) {
+		cmp = &sensor->comparators[i];
+		if (!cmp->enable)
+			continue;
+
+		zone = ssl_sensor_zone(cmp, ssl_sensor_channel_value(
+				&sensor->channels[i], sample->data));
+		if (zone != cmp->zone)
+			crossed |= BIT(i);
+		cmp->zone = zone;
+
+		if (zone == ZONE_ABOVE)
+			above |= BIT(i);
+		else if (zone == ZONE_BELOW)
+			below |= BIT(i);
+	}
+
+	if (!crossed)
+		return false;
+
+	sensor->event->timestamp = sample->timestamp;
+	sensor->event->crossed = crossed;
+	sensor->event->above = above;
+	sensor->event->below = below;
+	memcpy(sensor->event->data, sample->data, sensor->desc->record_size);
+	sensor->event_seq++;
+	sensor->events++;
+	trace_ssl_sensor_event(sensor->misc.name, crossed, above, below);
+
+	return true;
+}
+
+/*
+ * @brief Moves the window on to the bucket of time t, clearing the
+ *        buckets in between. Starts over after a gap longer than the
+ *        window.
+ */
+static void ssl_sensor_window_advance(struct ssl_sensor_window *w, u64 t)
+{
+	if (t - w->edge_ns >= w->length_ns) {
+		memset(w->count, 0, sizeof(w->count));
+		w->cur = 0;
+		w->start_ns[0] = t;
+		w->edge_ns = t + w->bucket_ns;
+		return;
+	}
+
+	while (t >= w->edge_ns) {
+		w->cur = (w->cur + 1) % SSL_SENSOR_STATS_BUCKETS;
+		w->start_ns[w->cur] = w->edge_ns;
+		w->count[w->cur] = 0;
+		w->edge_ns += w->bucket_ns;
+	}
+}
+
+/*
+ * @brief Adds a sample to the current bucket of every window. Called
+ *        with the sensor lock held.
+ */
+static void ssl_sensor_stats_add(struct ssl_sensor *sensor,
+				 const struct ssl_sensor_sample *sample)
+{
+	struct ssl_sensor_window *w;
+	struct ssl_sensor_acc *acc;
+	u32 value;
+	s64 delta;
+	int i, j;
+
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++) {
+		w = &sensor->windows[i];
+		if (!w->length_ns)
+			continue;
+
+		if (sample->timestamp >= w->edge_ns)
+			ssl_sensor_window_advance(w, sample->timestamp);
+
+		acc = w->acc + w->cur * sensor->num_channels;
+		for (j = 0; j < sensor->num_channels; j++, acc++) {
+			value = ssl_sensor_channel_value(&sensor->channels[j],
+							 sample->data);
+			if (w->count[w->cur] == 0) {
+				acc->ref = acc->min = acc->max = value;
+				acc->sum = 0;
+				acc->sumsq = 0;
+				continue;
+			}
+
+			acc->min = min(acc->min, value);
+			acc->max = max(acc->max, value);
+			delta = (s64)value - acc->ref;
+			acc->sum += delta;
+			acc->sumsq += delta * delta;
+		}
+		w->count[w->cur]++;
+	}
+}
+
+/*
+ * @brief Merges the buckets of a window that are not older than the
+ *        window into one record, num_channels entries.
+ */
+static void ssl_sensor_stats_get(struct ssl_sensor *sensor, unsigned int index,
+				 struct ssl_sensor_stats *stats)
+{
+	struct ssl_sensor_window *w = &sensor->windows[index];
+	struct ssl_sensor_stat *stat;
+	struct ssl_sensor_acc *acc;
+	unsigned long flags;
+	u64 now, sumsq, square;
+	s64 sum, offset;
+	u32 ref, n;
+	int b, i;
+
+	memset(stats, 0, sizeof(*stats) +
+	       sensor->num_channels * sizeof(*stats->channels));
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	now = ktime_get_ns();
+	stats->timestamp = now;
+	stats->window_ms = div_u64(w->length_ns, NSEC_PER_MSEC);
+	stats->num_channels = sensor->num_channels;
+
+	for (i = 0; i < sensor->num_channels; i++) {
+		stat = &stats->channels[i];
+		sum = 0;
+		sumsq = 0;
+		ref = 0;
+		n = 0;
+
+		for (b = 0; b < SSL_SENSOR_STATS_BUCKETS; b++) {
+			if (!w->count[b] || w->start_ns[b] + w->bucket_ns +
+			    w->length_ns <= now)
+				continue;
+
+			// shift the bucket sums to the reference of the first
+			acc = w->acc + b * sensor->num_channels + i;
+			if (n == 0) {
+				ref = acc->ref;
+				stat->min = acc->min;
+				stat->max = acc->max;
+			}
+			offset = (s64)acc->ref - ref;
+			sum += acc->sum + offset * w->count[b];
+			sumsq += acc->sumsq + 2 * offset * acc->sum +
+				offset * offset * w->count[b];
+			stat->min = min(stat->min, acc->min);
+			stat->max = max(stat->max, acc->max);
+			n += w->count[b];
+		}
+
+		if (n == 0)
+			continue;
+
+		stat->mean = ((u64)ref << 8) + div_s64(sum * 256, n);
+		square = div64_u64(sum * sum, n);
+		stat->variance = sumsq > square ? div_u64(sumsq - square, n) : 0;
+		stats->count = n;
+	}
+	spin_unlock_irqrestore(&sensor->lock, flags);
+}
+
+/*
+ * @brief Sets the length of a window and clears it. Called with the
+ *        sensor lock held.
+ */
+static void ssl_sensor_window_set(struct ssl_sensor_window *w,
+				  unsigned int ms)
+{
+	w->length_ns = (u64)ms * NSEC_PER_MSEC;
+	w->bucket_ns = div_u64(w->length_ns, SSL_SENSOR_STATS_BUCKETS);
+	w->edge_ns = 0;
+	w->cur = 0;
+	memset(w->count, 0, sizeof(w->count));
+}
+
+/*
+ * @brief Takes a sample into the history ring and runs the comparators.
+ */
+static void ssl_sensor_sample(struct ssl_sensor *sensor)
+{
+	struct ssl_sensor_sample *sample;
+	unsigned long flags;
+	u64 mmio;
+	bool wake;
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	if (sensor->dead) {
+		spin_unlock_irqrestore(&sensor->lock, flags);
+		return;
+	}
+	write_seqcount_begin(&sensor->seq);
+	sample = ssl_sensor_slot(sensor, sensor->head);
+	sample->timestamp = ktime_get_ns();
+	if (sensor->desc->sample)
+		sensor->desc->sample(sensor, sample->data);
+	else
+		regmap_bulk_read(sensor->map, 0, sample->data,
+				 sensor->desc->record_size / 4);
+	mmio = ktime_get_ns() - sample->timestamp;
+	sensor->mmio_ns += mmio;
+	sensor->samples_taken++;
+	trace_ssl_sensor_sample(sensor->misc.name, sensor->head, mmio);
+
+	// publish to mmap readers
+	smp_store_release(&sensor->hdr->head, ++sensor->head);
+
+	wake = sensor->armed && ssl_sensor_compare(sensor, sample);
+	write_seqcount_end(&sensor->seq);
+	ssl_sensor_stats_add(sensor, sample);
+	spin_unlock_irqrestore(&sensor->lock, flags);
+
+	if (wake)
+		wake_up_interruptible(&sensor->wait);
+	if (wq_has_sleeper(&sensor->sample_wait))
+		wake_up_interruptible(&sensor->sample_wait);
+}
+
+/*
+ * @brief Timer function of the periodic sampler.
+ */
+static enum hrtimer_restart ssl_sensor_timer(struct hrtimer *timer)
+{
+	struct ssl_sensor *sensor = container_of(timer, struct ssl_sensor,
+						 timer);
+	unsigned int period_us = READ_ONCE(sensor->period_us);
+	u64 expires = ktime_to_ns(hrtimer_get_expires(timer));
+	u64 latency;
+
+	if (period_us == 0)
+		return HRTIMER_NORESTART;
+
+	ssl_sensor_sample(sensor);
+
+	// only the timer writes these
+	latency = ktime_get_ns() - expires;
+	if (latency > sensor->max_wakeup_ns)
+		sensor->max_wakeup_ns = latency;
+	sensor->timer_runs++;
+
+	hrtimer_forward_now(timer, ns_to_ktime((u64)period_us * NSEC_PER_USEC));
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * @brief Copies the sample with the given index out of the history.
+ *        Lock free, the copy is retried if the sampler ran meanwhile.
+ *
+ * @return false if the sample is not (or no longer) in the history.
+ */
+static bool ssl_sensor_get_sample(struct ssl_sensor *sensor, u32 index,
+				  struct ssl_sensor_sample *sample)
+{
+	unsigned int seq;
+	bool valid;
+
+	do {
+		seq = read_seqcount_begin(&sensor->seq);
+		valid = sensor->head - index - 1 <= sensor->mask &&
+			sensor->samples_taken > sensor->head - index - 1;
+		if (valid)
+			memcpy(sample, ssl_sensor_slot(sensor, index),
+			       sensor->stride);
+	} while (read_seqcount_retry(&sensor->seq, seq));
+
+	return valid;
+}
+
+/*
+ * @brief Copies the newest sample, takes one if the sampler is off or
+ *        has not run yet.
+ *
+ * @return 0, or -EAGAIN if the sample taken is not in the history.
+ */
+static int ssl_sensor_get_newest(struct ssl_sensor *sensor,
+				 struct ssl_sensor_sample *sample)
+{
+	if (READ_ONCE(sensor->period_us) != 0 &&
+	    ssl_sensor_get_sample(sensor, READ_ONCE(sensor->head) - 1, sample))
+		return 0;
+
+	ssl_sensor_sample(sensor);
+	if (!ssl_sensor_get_sample(sensor, READ_ONCE(sensor->head) - 1, sample))
+		return -EAGAIN;
+
+	return 0;
+}
+
+/*
+ * @brief Returns true if there is an event the file has not seen yet.
+ */
+static bool ssl_sensor_event_pending(struct ssl_sensor_file *file)
+{
+	return READ_ONCE(file->sensor->event_seq) != file->event_seq;
+}
+
+/*
+ * @brief Blocks until a comparator changes zone and hands out the event.
+ */
+static ssize_t ssl_sensor_read_event(struct ssl_sensor_file *file,
+				     struct file *filep, struct iov_iter *to)
+{
+	struct ssl_sensor *sensor = file->sensor;
+	size_t size = sizeof(*sensor->event) + sensor->desc->record_size;
+	u64 event[EVENT_BUF_WORDS];
+	unsigned int seq;
+	u32 event_seq;
+
+	if (iov_iter_count(to) < size)
+		return -EINVAL;
+
+	while (!ssl_sensor_event_pending(file)) {
+		if (filep->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(sensor->wait,
+					     ssl_sensor_event_pending(file) ||
+					     READ_ONCE(sensor->dead)))
+			return -ERESTARTSYS;
+		if (READ_ONCE(sensor->dead))
+			return -ENODEV;
+	}
+
+	do {
+		seq = read_seqcount_begin(&sensor->seq);
+		memcpy(event, sensor->event, size);
+		event_seq = sensor->event_seq;
+	} while (read_seqcount_retry(&sensor->seq, seq));
+	file->event_seq = event_seq;
+
+	if (copy_to_iter(event, size, to) != size)
+		return -EFAULT;
+
+	return size;
+}
+
+/*
+ * @brief Returns the stream position of a file, moved past samples the
+ *        history no longer holds.
+ */
+static u32 ssl_sensor_cursor(struct ssl_sensor_file *file, u32 head)
+{
+	u32 size = file->sensor->mask + 1;
+
+	if (head - file->cursor > size)
+		return head - size;
+
+	return file->cursor;
+}
+
+/*
+ * @brief Returns true if there is a sample the file has not read yet.
+ */
+static bool ssl_sensor_sample_pending(struct ssl_sensor_file *file)
+{
+	return READ_ONCE(file->sensor->head) != READ_ONCE(file->cursor);
+}
+
+/*
+ * @brief Hands out all samples the file has not read yet, as many as
+ *        fit, oldest first. Blocks for the next one if there are none.
+ */
+static ssize_t ssl_sensor_read_stream(struct ssl_sensor_file *file,
+				      struct file *filep, struct iov_iter *to)
+{
+	struct ssl_sensor *sensor = file->sensor;
+	u64 buffer[SAMPLE_BUF_WORDS];
+	struct ssl_sensor_sample *sample = (void *)buffer;
+	unsigned int skipped = 0;
+	ssize_t copied = 0;
+	u32 head, cursor;
+
+	if (iov_iter_count(to) < sensor->stride)
+		return -EINVAL;
+
+	// without the sampler every read takes a fresh sample
+	if (READ_ONCE(sensor->period_us) == 0 &&
+	    !ssl_sensor_sample_pending(file))
+		ssl_sensor_sample(sensor);
+
+	if (mutex_lock_interruptible(&file->lock))
+		return -ERESTARTSYS;
+
+	while (!ssl_sensor_sample_pending(file)) {
+		mutex_unlock(&file->lock);
+
+		if (filep->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(sensor->sample_wait,
+					     ssl_sensor_sample_pending(file) ||
+					     READ_ONCE(sensor->dead)))
+			return -ERESTARTSYS;
+		if (READ_ONCE(sensor->dead))
+			return -ENODEV;
+
+		if (mutex_lock_interruptible(&file->lock))
+			return -ERESTARTSYS;
+	}
+
+	head = READ_ONCE(sensor->head);
+	cursor = ssl_sensor_cursor(file, head);
+	skipped = cursor - file->cursor;
+
+	while (iov_iter_count(to) >= sensor->stride && cursor != head) {
+		// skips samples the sampler overwrote in the meantime
+		if (!ssl_sensor_get_sample(sensor, cursor++, sample)) {
+			skipped++;
+			continue;
+		}
+
+		if (copy_to_iter(sample, sensor->stride, to) !=
+		    sensor->stride) {
+			if (copied == 0)
+				copied = -EFAULT;
+			cursor--;
+			break;
+		}
+		copied += sensor->stride;
+	}
+	WRITE_ONCE(file->cursor, cursor);
+
+	mutex_unlock(&file->lock);
+
+	if (skipped)
+		atomic64_add(skipped, &sensor->skipped);
+
+	return copied;
+}
+
+/*
+ * @brief Hands out one record per enabled statistics window, as many
+ *        as fit.
+ */
+static ssize_t ssl_sensor_read_stats(struct ssl_sensor *sensor,
+				     struct iov_iter *to)
+{
+	size_t size = sizeof(struct ssl_sensor_stats) +
+		sensor->num_channels * sizeof(struct ssl_sensor_stat);
+	struct ssl_sensor_stats *stats;
+	ssize_t copied = 0;
+	int i;
+
+	if (iov_iter_count(to) < size)
+		return -EINVAL;
+
+	stats = kmalloc(size, GFP_KERNEL);
+	if (stats == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS &&
+	     iov_iter_count(to) >= size; i++) {
+		if (!READ_ONCE(sensor->windows[i].length_ns))
+			continue;
+
+		ssl_sensor_stats_get(sensor, i, stats);
+		if (copy_to_iter(stats, size, to) != size) {
+			if (copied == 0)
+				copied = -EFAULT;
+			break;
+		}
+		copied += size;
+	}
+	kfree(stats);
+
+	return copied;
+}
+
+/*
+ * @brief Frees the sensor state once the device and the last open file
+ *        let go of it.
+ */
+static void ssl_sensor_free(struct kref *ref)
+{
+	struct ssl_sensor *sensor = container_of(ref, struct ssl_sensor, ref);
+	int i;
+
+	vfree(sensor->ring);
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++)
+		kfree(sensor->windows[i].acc);
+	kfree(sensor->event);
+	if (sensor->channels != sensor->desc->channels)
+		kfree(sensor->channels);
+	kfree(sensor->misc.name);
+	kfree(sensor);
+}
+
+/*
+ * @brief This function gets executed on open.
+ */
+static int ssl_sensor_open(struct inode *inode, struct file *filep)
+{
+	struct ssl_sensor_file *file;
+	struct ssl_sensor *sensor;
+
+	// misc_open() stored the miscdevice in private_data, and runs
+	// under the misc lock so remove cannot drop the sensor meanwhile
+	sensor = container_of(filep->private_data, struct ssl_sensor, misc);
+
+	// desc and the sample hook live in the driver module
+	if (!try_module_get(sensor->owner))
+		return -ENODEV;
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (file == NULL) {
+		module_put(sensor->owner);
+		return -ENOMEM;
+	}
+
+	kref_get(&sensor->ref);
+	file->sensor = sensor;
+	mutex_init(&file->lock);
+	file->mode = SSL_SENSOR_MODE_REGS;
+	file->event_seq = READ_ONCE(file->sensor->event_seq);
+	filep->private_data = file;
+
+	return 0;
+}
+
+/*
+ * @brief This function gets executed on close.
+ */
+static int ssl_sensor_release(struct inode *inode, struct file *filep)
+{
+	struct ssl_sensor_file *file = filep->private_data;
+	struct ssl_sensor *sensor = file->sensor;
+	struct module *owner = sensor->owner;
+
+	kfree(file);
+	kref_put(&sensor->ref, ssl_sensor_free);
+	module_put(owner);
+
+	return 0;
+}
+
+/*
+ * @brief Hands out the newest record, the file offset selects the
+ *        registers.
+ */
+static ssize_t ssl_sensor_read_regs(struct ssl_sensor *sensor,
+				    loff_t *offp, struct iov_iter *to)
+{
+	unsigned int record_size = sensor->desc->record_size;
+	u64 buffer[SAMPLE_BUF_WORDS];
+	struct ssl_sensor_sample *sample = (void *)buffer;
+	size_t count = iov_iter_count(to);
+	int retval;
+
+	if ((*offp < 0) || (*offp >= record_size))
+		return 0;
+
+	if ((*offp + count) > record_size)
+		count = record_size - *offp;
+
+	if (count > 0) {
+		// serve the newest sample from RAM
+		retval = ssl_sensor_get_newest(sensor, sample);
+		if (retval)
+			return retval;
+		count = copy_to_iter(sample->data + *offp, count, to);
+
+		*offp += count;
+	}
+	return count;
+}
+
+/*
+ * @brief This function gets executed on fread and readv.
+ */
+static ssize_t ssl_sensor_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filep = iocb->ki_filp;
+	struct ssl_sensor_file *file = filep->private_data;
+	struct ssl_sensor *sensor = file->sensor;
+	u64 start = ktime_get_ns();
+	ssize_t retval;
+
+	if (READ_ONCE(sensor->dead))
+		return -ENODEV;
+
+	if (file->mode == SSL_SENSOR_MODE_EVENTS)
+		retval = ssl_sensor_read_event(file, filep, to);
+	else if (file->mode == SSL_SENSOR_MODE_STREAM)
+		retval = ssl_sensor_read_stream(file, filep, to);
+	else if (file->mode == SSL_SENSOR_MODE_STATS)
+		retval = ssl_sensor_read_stats(sensor, to);
+	else
+		retval = ssl_sensor_read_regs(sensor, &iocb->ki_pos, to);
+
+	if (retval > 0)
+		atomic64_add(retval, &sensor->bytes_read);
+	trace_ssl_sensor_read(sensor->misc.name, file->mode, retval,
+			      ktime_get_ns() - start);
+
+	return retval;
+}
+
+/*
+ * @brief This function gets executed on poll/select.
+ */
+static unsigned int ssl_sensor_poll(struct file *filep, poll_table *wait)
+{
+	struct ssl_sensor_file *file = filep->private_data;
+
+	if (READ_ONCE(file->sensor->dead))
+		return POLLERR | POLLHUP;
+
+	if (file->mode == SSL_SENSOR_MODE_STREAM) {
+		poll_wait(filep, &file->sensor->sample_wait, wait);
+		if (ssl_sensor_sample_pending(file))
+			return POLLIN | POLLRDNORM;
+		return 0;
+	}
+
+	// records can always be read
+	if (file->mode != SSL_SENSOR_MODE_EVENTS)
+		return POLLIN | POLLRDNORM;
+
+	poll_wait(filep, &file->sensor->wait, wait);
+
+	if (ssl_sensor_event_pending(file))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/*
+ * @brief Maps the history ring read-only to userspace.
+ */
+static int ssl_sensor_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct ssl_sensor_file *file = filep->private_data;
+	struct ssl_sensor *sensor = file->sensor;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (READ_ONCE(sensor->dead))
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (vma->vm_pgoff != 0 || size > sensor->ring_bytes)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, sensor->ring, 0);
+}
+
+/*
+ * @brief Copies the most recent samples to userspace, oldest first.
+ */
+static int ssl_sensor_read_history(struct ssl_sensor *sensor,
+				   struct ssl_sensor_history __user *arg)
+{
+	u64 buffer[SAMPLE_BUF_WORDS];
+	struct ssl_sensor_sample *sample = (void *)buffer;
+	struct ssl_sensor_history history;
+	u8 __user *buf;
+	u32 head;
+	u32 index;
+	u32 copied = 0;
+
+	if (copy_from_user(&history, arg, sizeof(history)))
+		return -EFAULT;
+
+	buf = (u8 __user *)(unsigned long)history.buf;
+	history.count = min(history.count, sensor->mask + 1);
+	head = READ_ONCE(sensor->head);
+	index = head - history.count;
+
+	while (copied < history.count && index != head) {
+		// skips samples the sampler overwrote in the meantime
+		if (!ssl_sensor_get_sample(sensor, index++, sample))
+			continue;
+		if (copy_to_user(buf + copied * sensor->stride, sample,
+				 sensor->stride))
+			return -EFAULT;
+		copied++;
+	}
+
+	history.count = copied;
+	if (copy_to_user(arg, &history, sizeof(history)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * @brief Configures the comparator of one channel.
+ */
+static int ssl_sensor_set_threshold(struct ssl_sensor *sensor,
+				    const struct ssl_sensor_threshold *t)
+{
+	struct ssl_sensor_comparator *cmp;
+	unsigned long flags;
+
+	if (t->channel >= sensor->num_channels || t->low > t->high)
+		return -EINVAL;
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	cmp = &sensor->comparators[t->channel];
+	cmp->enable = t->enable;
+	cmp->low = t->low;
+	cmp->high = t->high;
+	cmp->hysteresis = t->hysteresis;
+	cmp->zone = ZONE_INSIDE;
+	if (cmp->enable)
+		sensor->armed |= BIT(t->channel);
+	else
+		sensor->armed &= ~BIT(t->channel);
+	spin_unlock_irqrestore(&sensor->lock, flags);
+
+	return 0;
+}
+
+/*
+ * @brief This function gets executed on ioctl.
+ */
+static long ssl_sensor_ioctl(struct file *filep, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct ssl_sensor_file *file = filep->private_data;
+	struct ssl_sensor *sensor = file->sensor;
+	void __user *argp = (void __user *)arg;
+	struct ssl_sensor_threshold threshold;
+	struct ssl_sensor_comparator *cmp;
+	struct ssl_sensor_info info;
+	unsigned long flags;
+	u32 mode;
+	int i;
+
+	if (READ_ONCE(sensor->dead))
+		return -ENODEV;
+
+	switch (cmd) {
+	case SSL_SENSOR_IOC_GET_INFO:
+		memset(&info, 0, sizeof(info));
+		info.version = SSL_SENSOR_VERSION;
+		info.record_size = sensor->desc->record_size;
+		info.num_channels = sensor->num_channels;
+		info.history_size = sensor->mask + 1;
+		info.sample_stride = sensor->stride;
+		for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++)
+			if (READ_ONCE(sensor->windows[i].length_ns))
+				info.stats_windows++;
+		if (copy_to_user(argp, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+
+	case SSL_SENSOR_IOC_READ_HISTORY:
+		return ssl_sensor_read_history(sensor, argp);
+
+	case SSL_SENSOR_IOC_SET_THRESHOLD:
+		if (copy_from_user(&threshold, argp, sizeof(threshold)))
+			return -EFAULT;
+		return ssl_sensor_set_threshold(sensor, &threshold);
+
+	case SSL_SENSOR_IOC_GET_THRESHOLD:
+		if (copy_from_user(&threshold, argp, sizeof(threshold)))
+			return -EFAULT;
+		if (threshold.channel >= sensor->num_channels)
+			return -EINVAL;
+
+		spin_lock_irqsave(&sensor->lock, flags);
+		cmp = &sensor->comparators[threshold.channel];
+		threshold.enable = cmp->enable;
+		threshold.low = cmp->low;
+		threshold.high = cmp->high;
+		threshold.hysteresis = cmp->hysteresis;
+		spin_unlock_irqrestore(&sensor->lock, flags);
+
+		if (copy_to_user(argp, &threshold, sizeof(threshold)))
+			return -EFAULT;
+		return 0;
+
+	case SSL_SENSOR_IOC_SET_MODE:
+		if (get_user(mode, (u32 __user *)argp))
+			return -EFAULT;
+		if (mode != SSL_SENSOR_MODE_REGS &&
+		    mode != SSL_SENSOR_MODE_EVENTS &&
+		    mode != SSL_SENSOR_MODE_STREAM &&
+		    mode != SSL_SENSOR_MODE_STATS)
+			return -EINVAL;
+
+		// streams start with the next sample
+		mutex_lock(&file->lock);
+		file->cursor = READ_ONCE(sensor->head);
+		file->mode = mode;
+		mutex_unlock(&file->lock);
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations ssl_sensor_fops = {
+	.owner = THIS_MODULE,
+	.open = ssl_sensor_open,
+	.release = ssl_sensor_release,
+	.read_iter = ssl_sensor_read_iter,
+	.splice_read = generic_file_splice_read,
+	.poll = ssl_sensor_poll,
+	.mmap = ssl_sensor_mmap,
+	.unlocked_ioctl = ssl_sensor_ioctl,
+};
+
+static inline struct ssl_sensor *dev_to_sensor(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct ssl_sensor, misc);
+}
+
+static ssize_t sample_period_us_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_sensor(dev)->period_us);
+}
+
+static ssize_t sample_period_us_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct ssl_sensor *sensor = dev_to_sensor(dev);
+	unsigned int value;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &value);
+	if (retval)
+		return retval;
+	if (value != 0 && value < MIN_PERIOD_US)
+		return -EINVAL;
+
+	hrtimer_cancel(&sensor->timer);
+	sensor->period_us = value;
+	if (value)
+		hrtimer_start(&sensor->timer, ktime_set(0, 0),
+			      HRTIMER_MODE_REL);
+
+	return count;
+}
+static DEVICE_ATTR_RW(sample_period_us);
+
+static ssize_t samples_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct ssl_sensor *sensor = dev_to_sensor(dev);
+	unsigned int seq;
+	u64 samples;
+
+	// 64 bit loads are not atomic on the A9
+	do {
+		seq = read_seqcount_begin(&sensor->seq);
+		samples = sensor->samples_taken;
+	} while (read_seqcount_retry(&sensor->seq, seq));
+
+	return sprintf(buf, "%llu\n", samples);
+}
+static DEVICE_ATTR_RO(samples);
+
+static ssize_t events_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", dev_to_sensor(dev)->events);
+}
+static DEVICE_ATTR_RO(events);
+
+static ssize_t stats_windows_ms_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct ssl_sensor *sensor = dev_to_sensor(dev);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++)
+		len += sprintf(buf + len, "%llu%c", div_u64(READ_ONCE(
+				sensor->windows[i].length_ns), NSEC_PER_MSEC),
+			       i == SSL_SENSOR_STATS_WINDOWS - 1 ? '\n' : ' ');
+
+	return len;
+}
+
+/*
+ * @brief Takes up to SSL_SENSOR_STATS_WINDOWS lengths in ms, 0 disables
+ *        a window. Windows not given keep their length, all are cleared.
+ */
+static ssize_t stats_windows_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct ssl_sensor *sensor = dev_to_sensor(dev);
+	unsigned int ms[SSL_SENSOR_STATS_WINDOWS];
+	unsigned long flags;
+	int num, i;
+
+	BUILD_BUG_ON(SSL_SENSOR_STATS_WINDOWS != 3);
+	num = sscanf(buf, "%u %u %u", &ms[0], &ms[1], &ms[2]);
+	if (num < 1)
+		return -EINVAL;
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++)
+		ssl_sensor_window_set(&sensor->windows[i], i < num ? ms[i] :
+			div_u64(sensor->windows[i].length_ns, NSEC_PER_MSEC));
+	spin_unlock_irqrestore(&sensor->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(stats_windows_ms);
+
+/*
+ * @brief One line per window and channel: window in ms, channel,
+ *        samples, min, max, mean and variance.
+ */
+static ssize_t stats_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct ssl_sensor *sensor = dev_to_sensor(dev);
+	struct ssl_sensor_stats *stats;
+	struct ssl_sensor_stat *stat;
+	ssize_t len = 0;
+	int i, j;
+
+	stats = kmalloc(sizeof(*stats) + sensor->num_channels *
+			sizeof(*stats->channels), GFP_KERNEL);
+	if (stats == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++) {
+		if (!READ_ONCE(sensor->windows[i].length_ns))
+			continue;
+
+		ssl_sensor_stats_get(sensor, i, stats);
+		for (j = 0; j < stats->num_channels; j++) {
+			stat = &stats->channels[j];
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%u %d %u %u %u %llu.%02llu %llu\n",
+					 stats->window_ms, j, stats->count,
+					 stat->min, stat->max, stat->mean >> 8,
+					 ((stat->mean & 0xff) * 100) >> 8,
+					 stat->variance);
+		}
+	}
+	kfree(stats);
+
+	return len;
+}
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute *ssl_sensor_attrs[] = {
+	&dev_attr_sample_period_us.attr,
+	&dev_attr_samples.attr,
+	&dev_attr_events.attr,
+	&dev_attr_stats_windows_ms.attr,
+	&dev_attr_stats.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(ssl_sensor);
+
+static int ssl_sensor_debugfs_atomic64_get(void *data, u64 *val)
+{
+	*val = atomic64_read(data);
+	return 0;
+}
+
+static int ssl_sensor_debugfs_atomic64_set(void *data, u64 val)
+{
+	atomic64_set(data, val);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(ssl_sensor_debugfs_atomic64_fops,
+			ssl_sensor_debugfs_atomic64_get,
+			ssl_sensor_debugfs_atomic64_set, "%llu\n");
+
+/*
+ * @brief Exports the statistics to /sys/kernel/debug/<device>. Writing
+ *        a value resets a counter. Debugfs is optional, errors are
+ *        ignored.
+ */
+static void ssl_sensor_debugfs_init(struct ssl_sensor *sensor)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(sensor->misc.name, NULL);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	sensor->debugfs = dir;
+
+	// the sampler timer is the interrupt of these sensors
+	debugfs_create_u64("interrupts", 0600, dir, &sensor->timer_runs);
+	// read only, ssl_sensor_get_sample() trusts it for the ring fill
+	debugfs_create_u64("samples", 0400, dir, &sensor->samples_taken);
+	debugfs_create_u64("mmio_ns", 0600, dir, &sensor->mmio_ns);
+	debugfs_create_u64("max_wakeup_ns", 0600, dir,
+			   &sensor->max_wakeup_ns);
+	debugfs_create_file("skipped", 0600, dir, &sensor->skipped,
+			    &ssl_sensor_debugfs_atomic64_fops);
+	debugfs_create_file("bytes_read", 0600, dir, &sensor->bytes_read,
+			    &ssl_sensor_debugfs_atomic64_fops);
+}
+
+/*
+ * @brief Allocates the history ring, header page first, samples after.
+ */
+static int ssl_sensor_ring_alloc(struct ssl_sensor *sensor, unsigned int size)
+{
+	size = roundup_pow_of_two(max(size, 1U));
+
+	sensor->stride = ALIGN(sizeof(struct ssl_sensor_sample) +
+			       sensor->desc->record_size, 8);
+	sensor->ring_bytes = PAGE_SIZE + PAGE_ALIGN(size * sensor->stride);
+	sensor->ring = vmalloc_user(sensor->ring_bytes);
+	if (sensor->ring == NULL)
+		return -ENOMEM;
+
+	sensor->hdr = sensor->ring;
+	sensor->samples = sensor->ring + PAGE_SIZE;
+	sensor->mask = size - 1;
+	sensor->head = 0;
+
+	sensor->hdr->version = SSL_SENSOR_VERSION;
+	sensor->hdr->size = size;
+	sensor->hdr->stride = sensor->stride;
+	sensor->hdr->data_offset = PAGE_SIZE;
+
+	return 0;
+}
+
+/*
+ * @brief Probes a sensor described by desc, maps its registers and
+ *        registers the misc device.
+ */
+int ssl_sensor_probe(struct platform_device *pdev,
+		     const struct ssl_sensor_desc *desc)
+{
+	struct regmap_config regmap_config = {
+		.reg_bits = 32,
+		.val_bits = 32,
+		.reg_stride = 4,
+		.fast_io = true, // sampled from the hrtimer
+		.cache_type = REGCACHE_NONE,
+	};
+	struct ssl_sensor *sensor;
+	struct ssl_sensor_channel *channels;
+	int retval;
+	int i;
+
+	if (desc->record_size == 0 || desc->record_size % 4 ||
+	    desc->record_size > SSL_SENSOR_MAX_RECORD)
+		return -EINVAL;
+
+	// not devm, open files may outlive the binding
+	sensor = kzalloc(sizeof(*sensor), GFP_KERNEL);
+	if (sensor == NULL)
+		return -ENOMEM;
+	kref_init(&sensor->ref);
+	platform_set_drvdata(pdev, sensor);
+	sensor->desc = desc;
+	sensor->dev = &pdev->dev;
+	sensor->owner = pdev->dev.driver->owner;
+
+	sensor->regs = fakefpga_ioremap(pdev, &sensor->size);
+	if (IS_ERR(sensor->regs)) {
+		retval = PTR_ERR(sensor->regs);
+		goto err_put;
+	}
+
+	// sensor registers are data only, nothing worth caching
+	regmap_config.name = desc->name;
+	regmap_config.max_register = desc->record_size - 4;
+	sensor->map = devm_regmap_init_mmio(&pdev->dev, sensor->regs,
+					    &regmap_config);
+	if (IS_ERR(sensor->map)) {
+		retval = PTR_ERR(sensor->map);
+		goto err_put;
+	}
+
+	if (desc->channels) {
+		sensor->channels = desc->channels;
+		sensor->num_channels = desc->num_channels;
+	} else {
+		// one channel per 32 bit word of the record
+		sensor->num_channels = desc->record_size / 4;
+		channels = kcalloc(sensor->num_channels, sizeof(*channels),
+				   GFP_KERNEL);
+		if (channels == NULL) {
+			retval = -ENOMEM;
+			goto err_put;
+		}
+		for (i = 0; i < sensor->num_channels; i++) {
+			channels[i].offset = i * 4;
+			channels[i].width = 4;
+		}
+		sensor->channels = channels;
+	}
+	sensor->num_channels = min_t(unsigned int, sensor->num_channels,
+				     SSL_SENSOR_MAX_CHANNELS);
+
+	sensor->event = kzalloc(sizeof(*sensor->event) + desc->record_size,
+				GFP_KERNEL);
+	if (sensor->event == NULL) {
+		retval = -ENOMEM;
+		goto err_put;
+	}
+
+	for (i = 0; i < SSL_SENSOR_STATS_WINDOWS; i++) {
+		sensor->windows[i].acc = kcalloc(
+				SSL_SENSOR_STATS_BUCKETS * sensor->num_channels,
+				sizeof(struct ssl_sensor_acc), GFP_KERNEL);
+		if (sensor->windows[i].acc == NULL) {
+			retval = -ENOMEM;
+			goto err_put;
+		}
+		ssl_sensor_window_set(&sensor->windows[i], stats_windows_ms[i]);
+	}
+
+	retval = ssl_sensor_ring_alloc(sensor, history_size);
+	if (retval)
+		goto err_put;
+
+	sensor->id = ida_simple_get(desc->ida, 0, 0, GFP_KERNEL);
+	if (sensor->id < 0) {
+		retval = sensor->id;
+		goto err_put;
+	}
+	sensor->misc.name = kasprintf(GFP_KERNEL, "%s%d", desc->name,
+				      sensor->id);
+	if (sensor->misc.name == NULL) {
+		retval = -ENOMEM;
+		goto err_free_id;
+	}
+
+	spin_lock_init(&sensor->lock);
+	seqcount_init(&sensor->seq);
+	init_waitqueue_head(&sensor->wait);
+	init_waitqueue_head(&sensor->sample_wait);
+	hrtimer_init(&sensor->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sensor->timer.function = ssl_sensor_timer;
+	sensor->period_us = desc->sample_period_us;
+	atomic64_set(&sensor->skipped, 0);
+	atomic64_set(&sensor->bytes_read, 0);
+
+	sensor->misc.minor = MISC_DYNAMIC_MINOR;
+	sensor->misc.fops = &ssl_sensor_fops;
+	sensor->misc.parent = &pdev->dev;
+	sensor->misc.groups = ssl_sensor_groups;
+	retval = misc_register(&sensor->misc);
+	if (retval) {
+		dev_err(&pdev->dev, "Register misc device failed!\n");
+		goto err_free_id;
+	}
+	ssl_sensor_debugfs_init(sensor);
+
+	if (sensor->period_us)
+		hrtimer_start(&sensor->timer, ktime_set(0, 0),
+			      HRTIMER_MODE_REL);
+
+	dev_info(&pdev->dev, "%s driver loaded!", sensor->misc.name);
+
+	return 0;
+
+err_free_id:
+	ida_simple_remove(desc->ida, sensor->id);
+err_put:
+	platform_set_drvdata(pdev, NULL);
+	kref_put(&sensor->ref, ssl_sensor_free);
+	return retval;
+}
+EXPORT_SYMBOL_GPL(ssl_sensor_probe);
+
+int ssl_sensor_remove(struct platform_device *pdev)
+{
+	struct ssl_sensor *sensor = platform_get_drvdata(pdev);
+	unsigned long flags;
+
+	debugfs_remove_recursive(sensor->debugfs);
+	misc_deregister(&sensor->misc);
+
+	// stop sampling, the registers go away with the binding
+	spin_lock_irqsave(&sensor->lock, flags);
+	WRITE_ONCE(sensor->dead, true);
+	sensor->period_us = 0;
+	spin_unlock_irqrestore(&sensor->lock, flags);
+	hrtimer_cancel(&sensor->timer);
+
+	// files still open see -ENODEV, wake the ones asleep in read()
+	wake_up_interruptible(&sensor->wait);
+	wake_up_interruptible(&sensor->sample_wait);
+
+	ida_simple_remove(sensor->desc->ida, sensor->id);
+	platform_set_drvdata(pdev, NULL);
+
+	// the ring stays until the last open file is gone
+	kref_put(&sensor->ref, ssl_sensor_free);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ssl_sensor_remove);
+
+MODULE_AUTHOR("Giritzer");
+MODULE_DESCRIPTION("Altera/Terasic register mapped sensor core");
+MODULE_LICENSE("GPL v2");
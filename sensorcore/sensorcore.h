@@ -0,0 +1,156 @@
+/*
+ * Terasic DE1-SoC register mapped sensor core
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _SENSORCORE_H
+#define _SENSORCORE_H
+
+#include <linux/platform_device.h>
+#include <linux/miscdevice.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/regmap.h>
+#include <linux/atomic.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+
+#include "ssl_sensor.h"
+
+#define SSL_SENSOR_MAX_RECORD 256
+#define SSL_SENSOR_STATS_BUCKETS 16
+
+struct ssl_sensor;
+
+/*
+ * A channel is a little endian value of width 1, 2 or 4 bytes at offset
+ * within the record. The comparators work on channels.
+ */
+struct ssl_sensor_channel {
+	const char *name;
+	unsigned int offset;
+	unsigned int width;
+};
+
+/*
+ * Static description of a sensor IP, everything the core needs to
+ * drive it.
+ */
+struct ssl_sensor_desc {
+	const char *name; // misc device name, numbered per instance
+	struct ida *ida; // instance numbers of this sensor type
+	unsigned int record_size; // multiple of 4, <= SSL_SENSOR_MAX_RECORD
+	const struct ssl_sensor_channel *channels; // NULL: one per 32 bit word
+	unsigned int num_channels;
+	unsigned int sample_period_us; // default, 0 disables the sampler
+
+	// optional, defaults to a bulk read of the first record_size bytes
+	void (*sample)(struct ssl_sensor *sensor, void *record);
+};
+
+struct ssl_sensor_comparator {
+	bool enable;
+	u32 low;
+	u32 high;
+	u32 hysteresis;
+	u8 zone;
+};
+
+/*
+ * Sums of one channel over one bucket, relative to the first value of
+ * the bucket to keep the squares small.
+ */
+struct ssl_sensor_acc {
+	u32 ref;
+	u32 min;
+	u32 max;
+	s64 sum;
+	u64 sumsq;
+};
+
+/*
+ * Rolling statistics window, a ring of buckets of bucket_ns each. A
+ * sample costs one update of the current bucket, expired buckets are
+ * cleared as the time moves on.
+ */
+struct ssl_sensor_window {
+	u64 length_ns; // 0 disables the window
+	u64 bucket_ns;
+	u64 edge_ns; // end of the current bucket
+	unsigned int cur;
+	u64 start_ns[SSL_SENSOR_STATS_BUCKETS];
+	u32 count[SSL_SENSOR_STATS_BUCKETS];
+	struct ssl_sensor_acc *acc; // num_channels per bucket
+};
+
+struct ssl_sensor {
+	const struct ssl_sensor_desc *desc;
+	struct device *dev;
+	void __iomem *regs;
+	struct regmap *map;
+	int size;
+	struct miscdevice misc;
+	int id; // instance number, misc device <name><id>
+
+	// held by the device and every open file, mappings hold their
+	// file. The registers are gone once dead is set, under lock, the
+	// ring stays until the last reference.
+	struct kref ref;
+	struct module *owner; // driver of desc, pinned by open files
+	bool dead;
+	const struct ssl_sensor_channel *channels;
+	unsigned int num_channels;
+
+	// periodic sampler, fills the history ring. Writers serialize on
+	// lock, readers copy samples and events out under seq without it.
+	struct hrtimer timer;
+	unsigned int period_us;
+	spinlock_t lock;
+	seqcount_t seq;
+	void *ring; // header page, then the samples
+	size_t ring_bytes;
+	struct ssl_sensor_ring_header *hdr;
+	void *samples;
+	unsigned int stride;
+	u32 mask;
+	u32 head; // index of the next sample
+
+	// software comparators
+	struct ssl_sensor_comparator comparators[SSL_SENSOR_MAX_CHANNELS];
+	u32 armed; // bitmask of enabled comparators
+	struct ssl_sensor_event *event; // newest zone change
+	u32 event_seq;
+	wait_queue_head_t wait; // event readers
+	wait_queue_head_t sample_wait; // stream readers
+
+	// rolling statistics, under lock
+	struct ssl_sensor_window windows[SSL_SENSOR_STATS_WINDOWS];
+
+	// statistics, the u64 ones are written under lock
+	struct dentry *debugfs;
+	u64 samples_taken;
+	unsigned long events;
+	u64 timer_runs;
+	u64 mmio_ns;
+	u64 max_wakeup_ns; // timer expiry to readers woken up
+	atomic64_t skipped; // lost by stream readers lapped by the ring
+	atomic64_t bytes_read;
+};
+
+int ssl_sensor_probe(struct platform_device *pdev,
+		     const struct ssl_sensor_desc *desc);
+int ssl_sensor_remove(struct platform_device *pdev);
+
+#endif /* _SENSORCORE_H */
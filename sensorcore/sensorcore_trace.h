@@ -0,0 +1,94 @@
+/*
+ * Terasic DE1-SoC register mapped sensor core - tracepoints
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ssl_sensor
+
+#if !defined(_SENSORCORE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SENSORCORE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * One sample taken into the history ring, by the sampler or a reader.
+ */
+TRACE_EVENT(ssl_sensor_sample,
+	TP_PROTO(const char *name, u32 index, u64 mmio_ns),
+	TP_ARGS(name, index, mmio_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u32, index)
+		__field(u64, mmio_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->index = index;
+		__entry->mmio_ns = mmio_ns;
+	),
+	TP_printk("%s index=%u mmio_ns=%llu", __get_str(name),
+		  __entry->index, __entry->mmio_ns)
+);
+
+/*
+ * A comparator changed zone, event readers get woken up.
+ */
+TRACE_EVENT(ssl_sensor_event,
+	TP_PROTO(const char *name, u32 crossed, u32 above, u32 below),
+	TP_ARGS(name, crossed, above, below),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u32, crossed)
+		__field(u32, above)
+		__field(u32, below)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->crossed = crossed;
+		__entry->above = above;
+		__entry->below = below;
+	),
+	TP_printk("%s crossed=%#x above=%#x below=%#x", __get_str(name),
+		  __entry->crossed, __entry->above, __entry->below)
+);
+
+/*
+ * One read() in any mode, duration_ns includes the wait for data.
+ */
+TRACE_EVENT(ssl_sensor_read,
+	TP_PROTO(const char *name, u32 mode, ssize_t ret, u64 duration_ns),
+	TP_ARGS(name, mode, ret, duration_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u32, mode)
+		__field(ssize_t, ret)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->mode = mode;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("%s mode=%u ret=%zd duration_ns=%llu", __get_str(name),
+		  __entry->mode, __entry->ret, __entry->duration_ns)
+);
+
+#endif /* _SENSORCORE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sensorcore_trace
+#include <trace/define_trace.h>
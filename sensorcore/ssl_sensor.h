@@ -0,0 +1,159 @@
+/*
+ * Terasic DE1-SoC register mapped sensors - userspace interface
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _SSL_SENSOR_H
+#define _SSL_SENSOR_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Common interface of all sensors driven by the sensor core (/dev/hdc,
+ * /dev/apds, ...). Each sensor hands out records of record_size bytes,
+ * SSL_SENSOR_IOC_GET_INFO tells the layout of the device at hand.
+ */
+#define SSL_SENSOR_VERSION 1
+#define SSL_SENSOR_MAX_CHANNELS 32
+#define SSL_SENSOR_STATS_WINDOWS 3
+
+struct ssl_sensor_info {
+	__u32 version;
+	__u32 record_size; // data bytes per record
+	__u32 num_channels;
+	__u32 history_size; // samples kept by the periodic sampler
+	__u32 sample_stride; // bytes per struct ssl_sensor_sample
+	__u32 stats_windows; // enabled rolling statistics windows
+	__u32 reserved[2];
+};
+
+/*
+ * One timestamped snapshot, sample_stride bytes in total.
+ */
+struct ssl_sensor_sample {
+	__u64 timestamp; // CLOCK_MONOTONIC in ns
+	__u8 data[];
+};
+
+/*
+ * SSL_SENSOR_IOC_READ_HISTORY: copies up to count of the most recent
+ *	samples, oldest first, to the array at buf (count * sample_stride
+ *	bytes) and sets count to the number of samples copied.
+ */
+struct ssl_sensor_history {
+	__u64 buf;
+	__u32 count;
+	__u32 reserved;
+};
+
+/*
+ * Software comparator of one channel. The value is inside while
+ * low <= value <= high. Leaving the band back towards it requires
+ * crossing the limit by more than hysteresis.
+ */
+struct ssl_sensor_threshold {
+	__u32 channel;
+	__u32 enable;
+	__u32 low;
+	__u32 high;
+	__u32 hysteresis;
+};
+
+/*
+ * Record returned by read() in SSL_SENSOR_MODE_EVENTS, followed by
+ * record_size data bytes. crossed has a bit set for every channel that
+ * changed zone, above/below describe the zones after the change, data
+ * is the snapshot the comparators saw.
+ */
+struct ssl_sensor_event {
+	__u64 timestamp; // CLOCK_MONOTONIC in ns
+	__u32 crossed;
+	__u32 above;
+	__u32 below;
+	__u32 reserved;
+	__u8 data[];
+};
+
+/*
+ * Rolling statistics of one channel over a window. Windows are kept
+ * in 16 buckets, they cover the last window_ms plus the part of the
+ * oldest bucket that already left it. The variance is exact while the
+ * values within a bucket stay within 2^24 of each other.
+ */
+struct ssl_sensor_stat {
+	__u32 min;
+	__u32 max;
+	__u64 mean; // in 1/256 units of the value
+	__u64 variance; // in units of the value squared
+};
+
+/*
+ * Record returned by read() in SSL_SENSOR_MODE_STATS, followed by
+ * num_channels struct ssl_sensor_stat.
+ */
+struct ssl_sensor_stats {
+	__u64 timestamp; // CLOCK_MONOTONIC in ns
+	__u32 window_ms;
+	__u32 count; // samples in the window
+	__u32 num_channels;
+	__u32 reserved;
+	struct ssl_sensor_stat channels[];
+};
+
+/*
+ * History ring shared read-only via mmap(). The header page is followed
+ * by size samples of stride bytes at data_offset. The sample of index i
+ * lives at (i & (size - 1)), head is the index of the next sample. A
+ * sample copied out is valid if head, read again afterwards, did not
+ * advance by size or more past its index.
+ */
+struct ssl_sensor_ring_header {
+	__u32 version;
+	__u32 size;
+	__u32 stride;
+	__u32 data_offset;
+	__u32 head;
+	__u32 reserved[3];
+};
+
+/*
+ * SSL_SENSOR_IOC_SET_MODE: SSL_SENSOR_MODE_REGS (default) reads the
+ *	newest record at the file offset. SSL_SENSOR_MODE_EVENTS makes
+ *	read() block until a comparator changes zone and return struct
+ *	ssl_sensor_event, poll() reports POLLIN only then.
+ *	SSL_SENSOR_MODE_STREAM ignores the file offset, read() returns as
+ *	many whole samples (sample_stride bytes, struct ssl_sensor_sample)
+ *	as fit, starting with the first sample taken after the mode was
+ *	set, and blocks until there is a new one. Without the periodic
+ *	sampler every read() takes a fresh sample. splice() and
+ *	sendfile() deliver the same data as read().
+ *	SSL_SENSOR_MODE_STATS makes read() return one struct
+ *	ssl_sensor_stats per enabled window, as many as fit, shortest
+ *	window first, without blocking. The windows are set in the
+ *	stats_windows_ms sysfs attribute. The mode is per open file.
+ */
+#define SSL_SENSOR_MODE_REGS 0
+#define SSL_SENSOR_MODE_EVENTS 1
+#define SSL_SENSOR_MODE_STREAM 2
+#define SSL_SENSOR_MODE_STATS 3
+
+#define SSL_SENSOR_IOC_MAGIC 's'
+
+#define SSL_SENSOR_IOC_GET_INFO _IOR(SSL_SENSOR_IOC_MAGIC, 1, struct ssl_sensor_info)
+#define SSL_SENSOR_IOC_READ_HISTORY _IOWR(SSL_SENSOR_IOC_MAGIC, 2, struct ssl_sensor_history)
+#define SSL_SENSOR_IOC_SET_THRESHOLD _IOW(SSL_SENSOR_IOC_MAGIC, 3, struct ssl_sensor_threshold)
+#define SSL_SENSOR_IOC_GET_THRESHOLD _IOWR(SSL_SENSOR_IOC_MAGIC, 4, struct ssl_sensor_threshold)
+#define SSL_SENSOR_IOC_SET_MODE _IOW(SSL_SENSOR_IOC_MAGIC, 5, __u32)
+
+#endif /* _SSL_SENSOR_H */
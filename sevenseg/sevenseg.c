@@ -21,6 +21,16 @@
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/regmap.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/idr.h>
+
+#include "fakefpga.h"
+
+#define CREATE_TRACE_POINTS
+#include "sevenseg_trace.h"
 
 #define DRIVER_NAME "sevensegment"
 
@@ -32,9 +42,17 @@
 
 struct altera_sevenseg {
 	void *regs;
+	struct regmap *map;
 	char buffer[CHAR_DEVICE_SIZE];
 	int size;
 	struct miscdevice misc;
+	int id; // instance number, misc device sevensegment<id>
+
+	// statistics, exported to debugfs
+	struct dentry *debugfs;
+	atomic64_t writes;
+	atomic64_t bytes_written;
+	atomic64_t mmio_ns;
 };
 
 /*
@@ -75,6 +93,7 @@ static int sevenseg_write(struct file *filep, const char *buf,
     char pwm_to_write[PWM_NUM+1];
 
     u32 enable_segments = 0;
+	u64 mmio;
 	struct altera_sevenseg *sevenseg = container_of(filep->private_data,
 					   struct altera_sevenseg, misc);
 
@@ -91,7 +110,6 @@ static int sevenseg_write(struct file *filep, const char *buf,
 	}
 
 	// Enable segments with valid values
-    iowrite32(0x00000000, sevenseg->regs + ENABLE_OFFSET);
 	for (i = 0; i < HEX_NUM; i++)
         if((sevenseg->buffer[i] >= '0' && sevenseg->buffer[i] <= '9') ||
            (sevenseg->buffer[i] >= 'a' && sevenseg->buffer[i] <= 'z') ||
@@ -105,12 +123,14 @@ static int sevenseg_write(struct file *filep, const char *buf,
         {
             values_to_write[i] = '0';
         }
-    iowrite32(enable_segments, sevenseg->regs + ENABLE_OFFSET);
+    // registers are cached, unchanged values are not written again
+    mmio = ktime_get_ns();
+    regmap_update_bits(sevenseg->map, ENABLE_OFFSET, ~0U, enable_segments);
 
     // write values to hex
     values_to_write[HEX_NUM] = '\0';
     result = kstrtol(values_to_write,16, &value);
-    iowrite32((u32)value, sevenseg->regs);
+    regmap_update_bits(sevenseg->map, 0, ~0U, (u32)value);
 
     // write pwm value
     for (i = HEX_NUM; i < CHAR_DEVICE_SIZE; i++)
@@ -119,8 +139,14 @@ static int sevenseg_write(struct file *filep, const char *buf,
     }
     pwm_to_write[PWM_NUM] = '\0';
     result = kstrtol(pwm_to_write,16, &value);
-    iowrite32((u32)value, sevenseg->regs + PWM_OFFSET);
+    regmap_update_bits(sevenseg->map, PWM_OFFSET, ~0U, (u32)value);
+    mmio = ktime_get_ns() - mmio;
 
+	atomic64_inc(&sevenseg->writes);
+	atomic64_add(count, &sevenseg->bytes_written);
+	atomic64_add(mmio, &sevenseg->mmio_ns);
+	trace_sevenseg_write(sevenseg->misc.name, count, enable_segments,
+			     mmio);
 
 	*offp += count;
 	return count;
@@ -132,10 +158,58 @@ static const struct file_operations sevenseg_fops = {
 	.write = sevenseg_write
 };
 
+static int sevenseg_debugfs_atomic64_get(void *data, u64 *val)
+{
+	*val = atomic64_read(data);
+	return 0;
+}
+
+static int sevenseg_debugfs_atomic64_set(void *data, u64 val)
+{
+	atomic64_set(data, val);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(sevenseg_debugfs_atomic64_fops,
+			sevenseg_debugfs_atomic64_get,
+			sevenseg_debugfs_atomic64_set, "%llu\n");
+
+/*
+ * @brief Exports the statistics to /sys/kernel/debug/<device>. Writing
+ *        a value resets a counter. Debugfs is optional, errors are
+ *        ignored.
+ */
+static void sevenseg_debugfs_init(struct altera_sevenseg *sevenseg)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(sevenseg->misc.name, NULL);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+	sevenseg->debugfs = dir;
+
+	debugfs_create_file("writes", 0600, dir, &sevenseg->writes,
+			    &sevenseg_debugfs_atomic64_fops);
+	debugfs_create_file("bytes_written", 0600, dir,
+			    &sevenseg->bytes_written,
+			    &sevenseg_debugfs_atomic64_fops);
+	debugfs_create_file("mmio_ns", 0600, dir, &sevenseg->mmio_ns,
+			    &sevenseg_debugfs_atomic64_fops);
+}
+
+static DEFINE_IDA(sevenseg_ida);
+
+static const struct regmap_config sevenseg_regmap_config = {
+	.name = DRIVER_NAME,
+	.reg_bits = 32,
+	.val_bits = 32,
+	.reg_stride = 4,
+	.max_register = ENABLE_OFFSET,
+	.cache_type = REGCACHE_FLAT,
+};
+
 static int sevenseg_probe(struct platform_device *pdev)
 {
 	struct altera_sevenseg *sevenseg;
-	struct resource *io;
 	int retval;
 
 	sevenseg = devm_kzalloc(&pdev->dev, sizeof(*sevenseg), GFP_KERNEL);
@@ -143,32 +217,60 @@ static int sevenseg_probe(struct platform_device *pdev)
 		return -ENOMEM;
 	platform_set_drvdata(pdev, sevenseg);
 
-	io = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	sevenseg->regs = devm_ioremap_resource(&pdev->dev, io);
+	sevenseg->regs = fakefpga_ioremap(pdev, &sevenseg->size);
 	if (IS_ERR(sevenseg->regs))
 		return PTR_ERR(sevenseg->regs);
-	sevenseg->size = io->end - io->start + 1;
 
-	sevenseg->misc.name = DRIVER_NAME;
+	sevenseg->map = devm_regmap_init_mmio(&pdev->dev, sevenseg->regs,
+					      &sevenseg_regmap_config);
+	if (IS_ERR(sevenseg->map))
+		return PTR_ERR(sevenseg->map);
+
+	// bring hardware and cache in sync, display off
+	regmap_write(sevenseg->map, ENABLE_OFFSET, 0);
+	regmap_write(sevenseg->map, 0, 0);
+	regmap_write(sevenseg->map, PWM_OFFSET, 0);
+
+	atomic64_set(&sevenseg->writes, 0);
+	atomic64_set(&sevenseg->bytes_written, 0);
+	atomic64_set(&sevenseg->mmio_ns, 0);
+
+	sevenseg->id = ida_simple_get(&sevenseg_ida, 0, 0, GFP_KERNEL);
+	if (sevenseg->id < 0)
+		return sevenseg->id;
+	sevenseg->misc.name = devm_kasprintf(&pdev->dev, GFP_KERNEL, "%s%d",
+					     DRIVER_NAME, sevenseg->id);
+	if (sevenseg->misc.name == NULL) {
+		retval = -ENOMEM;
+		goto err_free_id;
+	}
+
 	sevenseg->misc.minor = MISC_DYNAMIC_MINOR;
 	sevenseg->misc.fops = &sevenseg_fops;
 	sevenseg->misc.parent = &pdev->dev;
 	retval = misc_register(&sevenseg->misc);
 	if (retval) {
 		dev_err(&pdev->dev, "Register misc device failed!\n");
-		return retval;
+		goto err_free_id;
 	}
+	sevenseg_debugfs_init(sevenseg);
 
-	dev_info(&pdev->dev, "Seveseg driver loaded!");
+	dev_info(&pdev->dev, "%s driver loaded!", sevenseg->misc.name);
 
 	return 0;
+
+err_free_id:
+	ida_simple_remove(&sevenseg_ida, sevenseg->id);
+	return retval;
 }
 
 static int sevenseg_remove(struct platform_device *pdev)
 {
 	struct altera_sevenseg *sevenseg = platform_get_drvdata(pdev);
 
+	debugfs_remove_recursive(sevenseg->debugfs);
 	misc_deregister(&sevenseg->misc);
+	ida_simple_remove(&sevenseg_ida, sevenseg->id);
 
 	platform_set_drvdata(pdev, NULL);
 
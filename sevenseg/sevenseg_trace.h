@@ -0,0 +1,52 @@
+/*
+ * Terasic DE1-SoC seven segment driver - tracepoints
+ *
+ * Copyright (C) 2018 Daniel Giritzer <daniel@giritzer.eu>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sevenseg
+
+#if !defined(_SEVENSEG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SEVENSEG_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * One write() of the display string, mmio_ns spent in the regmap.
+ */
+TRACE_EVENT(sevenseg_write,
+	TP_PROTO(const char *name, size_t count, u32 enable, u64 mmio_ns),
+	TP_ARGS(name, count, enable, mmio_ns),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(size_t, count)
+		__field(u32, enable)
+		__field(u64, mmio_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->count = count;
+		__entry->enable = enable;
+		__entry->mmio_ns = mmio_ns;
+	),
+	TP_printk("%s count=%zu enable=%#x mmio_ns=%llu", __get_str(name),
+		  __entry->count, __entry->enable, __entry->mmio_ns)
+);
+
+#endif /* _SEVENSEG_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sevenseg_trace
+#include <trace/define_trace.h>
@@ -19,15 +19,26 @@
 #include <linux/uaccess.h>
 #include <linux/signal.h>
 #include <linux/sched.h> 
+#include <linux/slab.h>
 #include <asm/siginfo.h>	
 
 #define DRIVER_NAME "sigtest"
 #define BUFFER_SIZE 25
 #define PID_OFFSET 0
 #define SIG_TEST 44
+#define INSTANCES 1
 
-static char buffer[BUFFER_SIZE];
-static int pid;
+static unsigned int instances = INSTANCES;
+module_param(instances, uint, S_IRUGO);
+MODULE_PARM_DESC(instances, "Number of device nodes sigtest<n>");
+
+struct sigtest {
+	struct miscdevice misc;
+	char buffer[BUFFER_SIZE];
+	int pid;
+};
+
+static struct sigtest *sigtests;
 
 /*
  * @brief This function gets executed on fread.
@@ -35,6 +46,8 @@ static int pid;
 static int sigtest_read(struct file *filep, char *buf, size_t count,
 			 loff_t *offp)
 {
+	struct sigtest *sigtest = container_of(filep->private_data,
+					       struct sigtest, misc);
 
 	if ((*offp < 0) || (*offp >= BUFFER_SIZE))
 		return 0;
@@ -44,7 +57,7 @@ static int sigtest_read(struct file *filep, char *buf, size_t count,
 
 	if (count > 0) {
 		count = count - copy_to_user(buf,
-					     buffer + *offp,
+					     sigtest->buffer + *offp,
 					     count);
 
 		*offp += count;
@@ -58,6 +71,8 @@ static int sigtest_read(struct file *filep, char *buf, size_t count,
 static int sigtest_write(struct file *filep, const char *buf,
 			  size_t count, loff_t *offp)
 {
+	struct sigtest *sigtest = container_of(filep->private_data,
+					       struct sigtest, misc);
 	int result = 0;
 	struct siginfo info;
    	struct task_struct *t;
@@ -71,22 +86,22 @@ static int sigtest_write(struct file *filep, const char *buf,
 		count = BUFFER_SIZE - *offp;
 
 	if (count > 0) {
-		count = count - copy_from_user(buffer + *offp,
+		count = count - copy_from_user(sigtest->buffer + *offp,
 					       buf,
 					       count);
 	}
 
 	// set PID
-	result = kstrtoint(&buffer[PID_OFFSET], 10, &pid);
-	printk("PID: %d \n", pid);
+	result = kstrtoint(&sigtest->buffer[PID_OFFSET], 10, &sigtest->pid);
+	printk("PID: %d \n", sigtest->pid);
 	*offp += count;
 
 
 	// catch invalid PID
-        t = pid_task(find_vpid(pid), PIDTYPE_PID);
+        t = pid_task(find_vpid(sigtest->pid), PIDTYPE_PID);
 	if(t == NULL)
 	{
-		printk("Not process found PID: %d \n", pid);
+		printk("Not process found PID: %d \n", sigtest->pid);
 		return count;
 	}
 
@@ -99,7 +114,7 @@ static int sigtest_write(struct file *filep, const char *buf,
 	// Send signal to userspace application
 	send_sig_info(SIG_TEST, &info, t);
 
-	printk("Signal sent to PID: %d \n", pid);
+	printk("Signal sent to PID: %d \n", sigtest->pid);
 
 	return count;
 }
@@ -110,30 +125,60 @@ static const struct file_operations sigtest_fops = {
 	.write = sigtest_write
 };
 
-struct miscdevice sigtest = {
-    .minor = MISC_DYNAMIC_MINOR,
-    .name = DRIVER_NAME,
-    .fops = &sigtest_fops,
-};
+static void sigtest_del(struct sigtest *sigtest)
+{
+	misc_deregister(&sigtest->misc);
+	kfree(sigtest->misc.name);
+}
 
 static int __init misc_init(void)
 {
-
+	struct sigtest *sigtest;
 	int retval;
-	retval = misc_register(&sigtest);
-	if (retval) {
-		pr_err("Register misc device failed!\n");
-		return retval;
+	int i;
+
+	sigtests = kcalloc(instances, sizeof(*sigtests), GFP_KERNEL);
+	if (sigtests == NULL)
+		return -ENOMEM;
+
+	// one node with its own buffer and pid per instance
+	for (i = 0; i < instances; i++) {
+		sigtest = &sigtests[i];
+		sigtest->misc.minor = MISC_DYNAMIC_MINOR;
+		sigtest->misc.fops = &sigtest_fops;
+		sigtest->misc.name = kasprintf(GFP_KERNEL, "%s%d",
+					       DRIVER_NAME, i);
+		if (sigtest->misc.name == NULL) {
+			retval = -ENOMEM;
+			goto err_del;
+		}
+
+		retval = misc_register(&sigtest->misc);
+		if (retval) {
+			pr_err("Register misc device failed!\n");
+			kfree(sigtest->misc.name);
+			goto err_del;
+		}
 	}
 
-	pr_info("sigtest driver loaded!");
+	pr_info("sigtest driver loaded, %u instances!", instances);
 
 	return 0;
+
+err_del:
+	while (i--)
+		sigtest_del(&sigtests[i]);
+	kfree(sigtests);
+	return retval;
 }
 
 static void __exit misc_exit(void)
 {
-	misc_deregister(&sigtest);
+	int i;
+
+	for (i = 0; i < instances; i++)
+		sigtest_del(&sigtests[i]);
+	kfree(sigtests);
 }
 
 module_init(misc_init)